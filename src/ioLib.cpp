@@ -1,25 +1,482 @@
+#define _FILE_OFFSET_BITS 64
+
 #include "ioLib.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <deque>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 
 char STRING_TERMINATION = '\0';
 
+constexpr size_t GATHER_STAGING_SIZE   = 64 * 1024;
+constexpr size_t GATHER_COPY_THRESHOLD = 512;
+constexpr int    GATHER_MAX_VECTORS    = IOV_MAX < 1024 ? IOV_MAX : 1024;
+constexpr size_t COPY_BUFFER_SIZE      = 1024 * 1024;
+
+// latencies are kept in buckets of 8 per power of two (error < 12.5%)
+constexpr size_t LATENCY_SUB_BUCKETS   = 8;
+constexpr size_t LATENCY_BUCKETS       = LATENCY_SUB_BUCKETS * 62;
+
+constexpr uint32_t COMPRESSED_VERSION          = 1;
+constexpr size_t   COMPRESSED_BLOCK_SIZE       = 64 * 1024;
+constexpr size_t   COMPRESSED_BLOCK_HEADER     = 2 * sizeof(uint32_t);
+constexpr size_t   COMPRESSED_READAHEAD        = 4;
+constexpr int      WORKER_NOT_STARTED          = 0;
+constexpr int      WORKER_RUNNING              = 1;
+constexpr int      WORKER_UNAVAILABLE          = 2;
+constexpr size_t   COMPRESSED_HEADER_SIZE      = 16;
+constexpr size_t   COMPRESSED_FOOTER_SIZE      = 32;
+constexpr size_t   COMPRESSED_INDEX_ENTRY_SIZE = 2 * sizeof(uint64_t);
+constexpr char     COMPRESSED_MAGIC[]          = "IOLZ";
+constexpr char     COMPRESSED_FOOTER_MAGIC[]   = "IOLZ_END";
+constexpr size_t   LZ_HASH_BITS                = 12;
+constexpr size_t   LZ_MIN_MATCH                = 4;
+constexpr size_t   LZ_LAST_LITERALS            = 5;
+constexpr size_t   LZ_MATCH_SAFE_DISTANCE      = 12;
+constexpr size_t   LZ_MAX_OFFSET               = 65535;
+
+constexpr size_t   LOG_ARGS_SIZE         = 232;
+constexpr size_t   LOG_BATCH_SIZE        = 64 * 1024;
+constexpr uint16_t LOG_NULL_STRING       = UINT16_MAX;
+
+constexpr size_t FORMAT_CHUNK_SIZE     = 256;
+
+// pooled objects are linked through their first pointer-sized field by 
+// tagged pointers (48 bits of address and 16 bits of ABA counter)
+constexpr size_t   POOL_CACHE_SIZE        = 16;
+constexpr int      POOL_TAG_SHIFT         = 48;
+constexpr uint64_t POOL_POINTER_MASK      = (1ull << POOL_TAG_SHIFT) - 1;
+constexpr size_t   SMALL_FILE_HEADER_SIZE = 16;
+constexpr size_t   STREAM_BUFFER_SIZE     = 4096;
+
+struct Durability;
+struct Checksum;
+struct CompressedFile;
+
 struct File
 {
-    unsigned char buffer[BUFFER_SIZE] = {NULL};
-    FILE*         cfile               = NULL;
-    unsigned int  position            = 0;
-    unsigned int  correctBufferValues = 0;
-    int           fileEndReached      = 0;
-    char          mode                = 0;
+    void*           poolLink            = NULL;
+    unsigned char   buffer[BUFFER_SIZE] = {NULL};
+    FILE*           cfile               = NULL;
+    size_t          position            = 0;
+    size_t          correctBufferValues = 0;
+    int64_t         bufferOffset        = 0;
+    int             fileEndReached      = 0;
+    char            mode                = 0;
+    int             identified          = 0;
+    uint64_t        device              = 0;
+    uint64_t        inode               = 0;
+    Durability*     durability          = NULL;
+    Checksum*       checksum            = NULL;
+    CompressedFile* compressed          = NULL;
+    char            streamBuffer[STREAM_BUFFER_SIZE];
+};
+
+struct CsvFieldBounds
+{
+    size_t start  = 0;
+    size_t end    = 0;
+    size_t quotes = 0;
+};
+
+struct CsvReader
+{
+    File*           file           = NULL;
+    char            delimiter      = CSV_DEFAULT_DELIMITER;
+    char            quote          = CSV_DEFAULT_QUOTE;
+    CsvFieldBounds* bounds         = NULL;
+    CsvField*       fields         = NULL;
+    size_t          fieldsCapacity = 0;
+    char*           carry          = NULL;
+    size_t          carryLength    = 0;
+    size_t          carryCapacity  = 0;
+};
+
+struct CachedBlock
+{
+    uint64_t       device    = 0;
+    uint64_t       inode     = 0;
+    int64_t        index     = 0;
+    size_t         length    = 0;
+    unsigned char* data      = NULL;
+    CachedBlock*   prev      = NULL;
+    CachedBlock*   next      = NULL;
+    CachedBlock*   hashNext  = NULL;
+};
+
+struct BlockCache
+{
+    size_t         blockSize   = 0;
+    size_t         blocksCount = 0;
+    size_t         blocksUsed  = 0;
+    CachedBlock*   blocks      = NULL;
+    unsigned char* storage     = NULL;
+    CachedBlock**  table       = NULL;
+    size_t         tableSize   = 0;
+    CachedBlock*   newest      = NULL;
+    CachedBlock*   oldest      = NULL;
+};
+
+struct GatherWriter
+{
+    int            fd                          = -1;
+    struct iovec   vectors[GATHER_MAX_VECTORS];
+    int            vectorsCount                = 0;
+    unsigned char* staging                     = NULL;
+    size_t         stagingUsed                 = 0;
+    Checksum*      checksum                    = NULL;
+    File*          compressedFile              = NULL;
+};
+
+struct Durability
+{
+    std::mutex                            mutex;
+    std::condition_variable               synced;
+    int                                   policy           = DURABILITY_NONE;
+    std::chrono::nanoseconds              groupInterval    = {};
+    size_t                                groupBytes       = 0;
+    uint64_t                              recordsCommitted = 0;
+    uint64_t                              recordsSynced    = 0;
+    int                                   syncing          = 0;
+    int                                   syncFailed       = 0;
+    int64_t                               syncedOffset     = 0;
+    std::chrono::steady_clock::time_point groupStart       = {};
+    size_t                                syncsCount       = 0;
+    uint64_t                              maxLatency       = 0;
+    uint64_t                              latencies[LATENCY_BUCKETS] = {};
+};
+
+struct alignas(64) LogSlot
+{
+    std::atomic<size_t> sequence;
+    const char*         format;
+    uint32_t            argsLength;
+    unsigned char       args[LOG_ARGS_SIZE];
+};
+
+struct Logger
+{
+    File*                           file             = NULL;
+    int                             overflowPolicy   = LOG_OVERFLOW_BLOCK;
+    LogSlot*                        slots            = NULL;
+    size_t                          capacity         = 0;
+    alignas(64) std::atomic<size_t> enqueuePosition  = {0};
+    alignas(64) std::atomic<size_t> dequeuePosition  = {0};
+    std::atomic<size_t>             dropsCount       = {0};
+    size_t                          dropsReported    = 0;
+    std::atomic<int>                running          = {0};
+    std::thread                     consumer;
+    char*                           batch            = NULL;
+    size_t                          batchLength      = 0;
+    int                             writeFailed      = 0;
+};
+
+struct Xxh64State
+{
+    uint64_t      lanes[4]      = {};
+    uint64_t      totalLength   = 0;
+    unsigned char memory[32]    = {};
+    size_t        memoryUsed    = 0;
+};
+
+struct Checksum
+{
+    int           type          = CHECKSUM_NONE;
+    uint32_t      crc           = 0;
+    Xxh64State    xxh           = {};
+    int           verifyOnClose = 0;
+    uint64_t      expected      = 0;
+};
+
+struct DecodedBlock
+{
+    unsigned char* data   = NULL;
+    size_t         length = 0;
+};
+
+struct CompressedBlockInfo
+{
+    int64_t fileOffset = 0;
+    int64_t rawOffset  = 0;
+};
+
+struct CompressedFile
+{
+    CompressedBlockInfo*                  index           = NULL;
+    size_t                                blocksCount     = 0;
+    size_t                                indexCapacity   = 0;
+    int64_t                               rawLength       = 0;
+    int64_t                               indexOffset     = 0;
+
+    // reading
+    unsigned char*                        block           = NULL;
+    size_t                                blockLength     = 0;
+    size_t                                blockPosition   = 0;
+    size_t                                nextBlock       = 0;
+    std::atomic<int>                      decodeError     = {0};
+
+    // reading ahead: the worker decompresses blocks from readaheadNext on,
+    // ready holds the decompressed ones starting from readaheadFirst
+    std::thread                           worker;
+    int                                   workerState     = WORKER_NOT_STARTED;
+    std::mutex                            readaheadMutex;
+    std::condition_variable               readaheadChanged;
+    std::deque<DecodedBlock>              ready;
+    size_t                                readaheadFirst  = 0;
+    size_t                                readaheadNext   = 0;
+    uint64_t                              readaheadEpoch  = 0;
+    int                                   stopWorker      = 0;
+
+    // the last block decompressed by readAt
+    std::mutex                            lastAtMutex;
+    unsigned char*                        lastAtBlock     = NULL;
+    size_t                                lastAtNumber    = 0;
+    size_t                                lastAtLength    = 0;
+
+    // writing
+    unsigned char*                        raw             = NULL;
+    size_t                                rawUsed         = 0;
+    unsigned char*                        packed          = NULL;
+    int64_t                               fileOffset      = 0;
+};
+
+struct FormatSink
+{
+    int          (*write)(FormatSink* sink, const char* data, size_t length) = NULL;
+    void*          target   = NULL;
+    FormatCallback callback = NULL;
+    char*          buffer   = NULL;
+    size_t         capacity = 0;
+    size_t         used     = 0;
+    size_t         length   = 0;
+};
+
+// source of the arguments of formatToSink: next converts the next argument of
+// type 'c', 'd' or 's' to text, using scratch for the characters if needed
+struct FormatArgs
+{
+    int                (*next)(FormatArgs* args, char type, char* scratch, StringView* text) = NULL;
+    va_list              valist;
+    const unsigned char* encoded       = NULL;
+    size_t               encodedLength = 0;
+    size_t               encodedRead   = 0;
+};
+
+struct GatherStaging
+{
+    unsigned char* buffer = NULL;
+
+    ~GatherStaging();
+};
+
+struct FreeList
+{
+    std::atomic<uint64_t> head = {0};
+};
+
+struct PoolCache
+{
+    FreeList* list                   = NULL;
+    void*     items[POOL_CACHE_SIZE] = {};
+    size_t    count                  = 0;
+
+    explicit PoolCache(FreeList* poolList) : list(poolList) {}
+    ~PoolCache();
 };
 
-int updateBuffer  (File* file);
-int writeFormatted(File* file, const char* str, va_list valist);
+BlockCache* BLOCK_CACHE = NULL;
+std::mutex  BLOCK_CACHE_MUTEX;
+
+FreeList FILE_POOL       = {};
+FreeList SMALL_FILE_POOL = {};
+
+thread_local PoolCache FILE_POOL_CACHE      (&FILE_POOL);
+thread_local PoolCache SMALL_FILE_POOL_CACHE(&SMALL_FILE_POOL);
+
+thread_local GatherStaging GATHER_STAGING;
+
+int    updateBuffer         (File* file);
+int    writeFormatted       (File* file, const char* str, va_list valist);
+void   updateChecksum       (Checksum* checksum, const void* data, size_t bytesCount);
+size_t writeBytes           (File* file, const void* data, size_t bytesCount);
+int    openCompressed       (File* file);
+int    closeCompressed      (File* file);
+size_t readCompressed       (File* file, unsigned char* destination, size_t bytesCount);
+size_t writeCompressed      (File* file, const void* data, size_t bytesCount);
+int    seekCompressed       (File* file, int64_t target);
+size_t readCompressedAt     (File* file, int64_t offset, size_t length, unsigned char* destination);
+size_t intToChars           (int value, char* str);
+
+//-----------------------------------------------------------------------------
+//! Pushes item to the lock-free list. The link to the next item is stored in
+//! the first pointer-sized field of item, which has to be reserved for it 
+//! (popFreeList may read it even after item has been taken from the list).
+//-----------------------------------------------------------------------------
+void pushFreeList(FreeList* list, void* item)
+{
+    assert(list);
+    assert(item);
+    assert(((uint64_t) (uintptr_t) item & ~POOL_POINTER_MASK) == 0);
+
+    uint64_t head    = list->head.load(std::memory_order_relaxed);
+    uint64_t newHead = 0;
+    do
+    {
+        __atomic_store_n((void**) item, (void*) (uintptr_t) (head & POOL_POINTER_MASK), __ATOMIC_RELAXED);
+        newHead = (((head >> POOL_TAG_SHIFT) + 1) << POOL_TAG_SHIFT) | (uint64_t) (uintptr_t) item;
+    } while (!list->head.compare_exchange_weak(head, newHead, std::memory_order_release, 
+                                               std::memory_order_relaxed));
+}
+
+//-----------------------------------------------------------------------------
+//! Pops an item from the lock-free list. The counter in the head makes the 
+//! exchange fail if the head item has been popped and pushed back meanwhile.
+//!
+//! @return item or NULL if list is empty.
+//-----------------------------------------------------------------------------
+void* popFreeList(FreeList* list)
+{
+    assert(list);
+
+    uint64_t head = list->head.load(std::memory_order_acquire);
+    while ((head & POOL_POINTER_MASK) != 0)
+    {
+        void*    item    = (void*) (uintptr_t) (head & POOL_POINTER_MASK);
+        void*    next    = __atomic_load_n((void**) item, __ATOMIC_RELAXED);
+        uint64_t newHead = (((head >> POOL_TAG_SHIFT) + 1) << POOL_TAG_SHIFT) | (uint64_t) (uintptr_t) next;
+
+        if (list->head.compare_exchange_weak(head, newHead, std::memory_order_acquire, 
+                                             std::memory_order_acquire))
+        {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+//! Returns the items cached by a thread to the shared list when the thread 
+//! exits.
+//-----------------------------------------------------------------------------
+PoolCache::~PoolCache()
+{
+    for (size_t i = 0; i < count; i++)
+        pushFreeList(list, items[i]);
+
+    count = 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Frees the staging buffer of gathered writes of a thread when it exits.
+//-----------------------------------------------------------------------------
+GatherStaging::~GatherStaging()
+{
+    free(buffer);
+    buffer = NULL;
+}
+
+//-----------------------------------------------------------------------------
+//! Takes an item from the cache of the current thread or, if it's empty, 
+//! from the shared list of the pool.
+//!
+//! @return item or NULL if the pool is empty.
+//-----------------------------------------------------------------------------
+void* acquirePooled(PoolCache* cache)
+{
+    assert(cache);
+
+    if (cache->count > 0)
+        return cache->items[--cache->count];
+
+    return popFreeList(cache->list);
+}
+
+//-----------------------------------------------------------------------------
+//! Puts item to the cache of the current thread. If the cache is full, half
+//! of it is moved to the shared list of the pool first. 
+//!
+//! @note Items are never freed here: popFreeList of another thread may still
+//!       read the link of an item it has seen at the head of the list, even
+//!       after the item has been popped and reused. So the shared list only
+//!       shrinks in clearFilePool and holds no more items than have ever 
+//!       been in use at once.
+//-----------------------------------------------------------------------------
+void releasePooled(PoolCache* cache, void* item)
+{
+    assert(cache);
+
+    if (item == NULL)
+        return;
+
+    if (cache->count == POOL_CACHE_SIZE)
+    {
+        for (; cache->count > POOL_CACHE_SIZE / 2; cache->count--)
+            pushFreeList(cache->list, cache->items[cache->count - 1]);
+    }
+
+    cache->items[cache->count++] = item;
+}
+
+//-----------------------------------------------------------------------------
+//! Frees all the items of the pool cached by the current thread or kept in
+//! the shared list.
+//-----------------------------------------------------------------------------
+void clearPool(PoolCache* cache)
+{
+    assert(cache);
+
+    for (; cache->count > 0; cache->count--)
+        free(cache->items[cache->count - 1]);
+
+    void* item = NULL;
+    while ((item = popFreeList(cache->list)) != NULL)
+        free(item);
+}
+
+//-----------------------------------------------------------------------------
+//! Frees the File objects and small file buffers kept for reuse by openFile,
+//! closeFile and readSmallFile. Items cached by other threads are returned 
+//! to the pool when these threads exit.
+//!
+//! @note Mustn't be called while other threads open or close files or read 
+//!       small files, as they may still access the items being freed.
+//-----------------------------------------------------------------------------
+void clearFilePool()
+{
+    clearPool(&FILE_POOL_CACHE);
+    clearPool(&SMALL_FILE_POOL_CACHE);
+}
 
 //-----------------------------------------------------------------------------
 //! Opens the file with name filename (by default in the same directory as the
@@ -38,45 +495,227 @@ int writeFormatted(File* file, const char* str, va_list valist);
 //! @return a pointer to the File opened or NULL if an error occurred.
 //-----------------------------------------------------------------------------
 File* openFile(const char* fileName, const char mode)
+{
+    return openFile(fileName, mode, 0);
+}
+
+//-----------------------------------------------------------------------------
+//! Opens the file with name filename. Same as openFile(fileName, mode), but
+//! with additional flags.
+//!
+//! @param [in] filename  name of the file to open
+//! @param [in] mode      'r', 'w' or 'a' (see openFile(fileName, mode))
+//! @param [in] flags     OPEN_COMPRESSED - the file is stored as a sequence 
+//!                       of independently compressed blocks followed by an
+//!                       index of the blocks; all ioLib functions work with
+//!                       its uncompressed contents ('r' and 'w' modes only)
+//!
+//! @return a pointer to the File opened or NULL if an error occurred.
+//-----------------------------------------------------------------------------
+File* openFile(const char* fileName, const char mode, int flags)
 {
     if (fileName == NULL)
         return NULL;
 
+    if ((flags & OPEN_COMPRESSED) && mode == 'a')
+        return NULL;
+
     if (mode != 'r' &&
         mode != 'w' &&
         mode != 'a')
         return NULL;
 
+    // a reused File has all its fields reset below, but its buffer is left 
+    // as it is, since it's never read past correctBufferValues
+    File* file = (File*)acquirePooled(&FILE_POOL_CACHE);
+    if (file == NULL)
+        file = (File*)malloc(sizeof(File));
+
+    if (file == NULL)
+        return NULL;
+
     char strMode[] = { mode , '\0' };
     FILE* cFILE = fopen((const char*) fileName, strMode);
     if (cFILE == NULL)
+    {
+        releasePooled(&FILE_POOL_CACHE, file);
         return NULL;
+    }
 
-    File* file = (File*)calloc(1, sizeof(File));
-    if (file == NULL)
-        return NULL;
+    // the C stream uses the buffer of the pooled File instead of allocating
+    // its own, so only the FILE itself is allocated by each open
+    setvbuf(cFILE, file->streamBuffer, _IOFBF, STREAM_BUFFER_SIZE);
 
-    file->cfile = cFILE;
-    file->position = BUFFER_SIZE;
+    file->cfile               = cFILE;
+    file->position            = BUFFER_SIZE;
     file->correctBufferValues = 0;
-    file->mode = mode;
+    file->bufferOffset        = 0;
+    file->fileEndReached      = 0;
+    file->mode                = mode;
+    file->identified          = 0;
+    file->device              = 0;
+    file->inode               = 0;
+    file->durability          = NULL;
+    file->checksum            = NULL;
+    file->compressed          = NULL;
+
+    if ((flags & OPEN_COMPRESSED) && openCompressed(file) != 0)
+    {
+        fclose(cFILE);
+        releasePooled(&FILE_POOL_CACHE, file);
+        return NULL;
+    }
 
     return file;
 }
 
 //-----------------------------------------------------------------------------
-//! Closes the file. Sets correctBufferValues of file to 0.
+//! Closes the file. Sets correctBufferValues of file to 0. If the checksum 
+//! of file is to be verified (see verifyFileChecksum) and file is opened in
+//! 'r' mode, the rest of file is read to complete the checksum.
 //!
 //! @param [in] file  pointer to the file to be closed
+//!
+//! @return 0 on success and -1 if the checksum of file doesn't match the 
+//!         expected one, a block of compressed file failed to decompress or
+//!         an error occurred while writing the data left.
 //-----------------------------------------------------------------------------
-void closeFile(File* file)
+int closeFile(File* file)
 {
     if (file == NULL)
-        return;
+        return -1;
+
+    int result = 0;
+
+    if (file->durability != NULL)
+    {
+        if (file->durability->policy != DURABILITY_NONE &&
+            (fflush(file->cfile) != 0 || fdatasync(fileno(file->cfile)) != 0))
+            result = -1;
+
+        delete file->durability;
+    }
+
+    if (file->checksum != NULL)
+    {
+        if (file->checksum->verifyOnClose)
+        {
+            // skip to the end of file loading everything that's left
+            while (file->mode == 'r' && 
+                   (file->position >= BUFFER_SIZE || file->correctBufferValues == BUFFER_SIZE))
+            {
+                file->position = BUFFER_SIZE;
+                if (updateBuffer(file) != 0 || file->correctBufferValues == 0)
+                    break;
+            }
+
+            if (getFileChecksum(file) != file->checksum->expected)
+                result = -1;
+        }
+
+        free(file->checksum);
+    }
+
+    if (file->compressed != NULL && closeCompressed(file) != 0)
+        result = -1;
 
     file->correctBufferValues = 0;
-    fclose(file->cfile);
-    free(file);
+    if (fclose(file->cfile) != 0)
+        result = -1;
+    releasePooled(&FILE_POOL_CACHE, file);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads the whole file with name fileName (no larger than 
+//! SMALL_FILE_MAX_SIZE) into a pooled buffer. Regular files are normally 
+//! read with a single read call and no File is created. The contents are 
+//! followed by the string termination symbol.
+//!
+//! @param [in] fileName  name of the file to read
+//!
+//! @note The contents have to be released with releaseSmallFile.
+//!
+//! @return contents of the file (its str is NULL if the file is too large or 
+//!         an error occurred).
+//-----------------------------------------------------------------------------
+StringView readSmallFile(const char* fileName)
+{
+    StringView contents = {};
+    if (fileName == NULL)
+        return contents;
+
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return contents;
+
+    // files like the ones in /proc report size 0 and are read until the end
+    struct stat fileStat = {};
+    size_t      expected = SMALL_FILE_MAX_SIZE + 1;
+    if (fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0)
+    {
+        if ((uint64_t) fileStat.st_size > SMALL_FILE_MAX_SIZE)
+        {
+            close(fd);
+            return contents;
+        }
+
+        expected = (size_t) fileStat.st_size;
+    }
+
+    // the header of the buffer is reserved for the pool
+    char* pooled = (char*)acquirePooled(&SMALL_FILE_POOL_CACHE);
+    if (pooled == NULL)
+        pooled = (char*)malloc(SMALL_FILE_HEADER_SIZE + SMALL_FILE_MAX_SIZE + 1);
+
+    if (pooled == NULL)
+    {
+        close(fd);
+        return contents;
+    }
+
+    char* buffer = pooled + SMALL_FILE_HEADER_SIZE;
+
+    size_t length = 0;
+    while (length < expected)
+    {
+        ssize_t result = read(fd, buffer + length, SMALL_FILE_MAX_SIZE + 1 - length);
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result <= 0)
+            break;
+
+        length += (size_t) result;
+    }
+
+    int failed = length > SMALL_FILE_MAX_SIZE;
+    if (close(fd) != 0 || failed)
+    {
+        releasePooled(&SMALL_FILE_POOL_CACHE, pooled);
+        return contents;
+    }
+
+    buffer[length] = STRING_TERMINATION;
+
+    contents.str    = buffer;
+    contents.length = length;
+
+    return contents;
+}
+
+//-----------------------------------------------------------------------------
+//! Returns the buffer of the contents read by readSmallFile to the pool.
+//!
+//! @param [in] contents  
+//-----------------------------------------------------------------------------
+void releaseSmallFile(StringView contents)
+{
+    if (contents.str == NULL)
+        return;
+
+    releasePooled(&SMALL_FILE_POOL_CACHE, (void*) (contents.str - SMALL_FILE_HEADER_SIZE));
 }
 
 //-----------------------------------------------------------------------------
@@ -116,10 +755,45 @@ size_t readBufferFromFile(File* file, size_t typeSize, size_t count, void* buffe
     if (file        == NULL ||
         file->cfile == NULL ||
         buffer      == NULL ||
+        typeSize    == 0    ||
         (file->mode != 'r'))
         return FILE_END;
-    
-    size_t result = fread(buffer, typeSize, count, file->cfile);
+
+    size_t bytesCount = typeSize * count;
+    size_t bytesRead  = 0;
+
+    // the part that has already been loaded to the buffer of file
+    if (file->position < file->correctBufferValues)
+    {
+        bytesRead = file->correctBufferValues - file->position;
+        if (bytesRead > bytesCount)
+            bytesRead = bytesCount;
+
+        memcpy(buffer, file->buffer + file->position, bytesRead);
+        file->position += bytesRead;
+    }
+
+    if (bytesRead < bytesCount)
+    {
+        size_t freadResult = 0;
+        if (file->compressed != NULL)
+            freadResult = readCompressed(file, (unsigned char*) buffer + bytesRead, bytesCount - bytesRead);
+        else
+            freadResult = fread((char*) buffer + bytesRead, 1, bytesCount - bytesRead, file->cfile);
+        if (file->checksum != NULL)
+            updateChecksum(file->checksum, (char*) buffer + bytesRead, freadResult);
+
+        bytesRead += freadResult;
+
+        file->bufferOffset        += file->correctBufferValues + freadResult;
+        file->position             = BUFFER_SIZE;
+        file->correctBufferValues  = 0;
+
+        if (file->compressed != NULL && file->compressed->decodeError)
+            return FILE_END;
+    }
+
+    size_t result = bytesRead / typeSize;
     return result != count ? FILE_END : result;
 }
 
@@ -138,10 +812,11 @@ size_t writeBufferToFile(File* file, size_t typeSize, size_t count, void* buffer
     if (file        == NULL ||
         file->cfile == NULL ||
         buffer      == NULL ||
+        typeSize    == 0    ||
         (file->mode != 'w' && file->mode != 'a'))
         return FILE_END;
 
-    size_t result = fwrite(buffer, typeSize, count, file->cfile);
+    size_t result = writeBytes(file, buffer, typeSize * count) / typeSize;
     return result == EOF ? FILE_END : result;
 }
 
@@ -183,13 +858,23 @@ int updateBuffer(File* file)
     if (file->position < BUFFER_SIZE)
         return UPDATE_BUFFER_DENIED;
 
-    file->correctBufferValues = fread(file->buffer,
-                                      sizeof(char),
-                                      BUFFER_SIZE,
-                                      file->cfile);
+    file->bufferOffset += file->correctBufferValues;
+    if (file->compressed != NULL)
+        file->correctBufferValues = readCompressed(file, file->buffer, BUFFER_SIZE);
+    else
+        file->correctBufferValues = fread(file->buffer,
+                                          sizeof(char),
+                                          BUFFER_SIZE,
+                                          file->cfile);
+
+    if (file->checksum != NULL)
+        updateChecksum(file->checksum, file->buffer, file->correctBufferValues);
 
     file->position = 0;
 
+    if (file->compressed != NULL && file->compressed->decodeError)
+        return UPDATE_BUFFER_DENIED;
+
     return 0;
 }
 
@@ -236,6 +921,24 @@ int nextChar(File* file)
 //! @return line or NULL on failure.
 //-----------------------------------------------------------------------------
 char* nextLine(File* file, char* line, size_t maxLength)
+{
+    return nextLine(file, line, maxLength, NULL);
+}
+
+//-----------------------------------------------------------------------------
+//! Reads the next (maxLength - 1) characters from file to line. Adds '\0' at
+//! the end of line and reports its length, so that it doesn't have to be 
+//! calculated again (e.g. to make a StringView of line).
+//!
+//! @param [in]  file       pointer to the file from which line is to be read
+//! @param [in]  line       pointer to char* to which characters are to be read
+//! @param [in]  maxLength  max number of characters to read 
+//!                         (typically sizeof (line))
+//! @param [out] length     number of characters read to line (optional)
+//!
+//! @return line or NULL on failure.
+//-----------------------------------------------------------------------------
+char* nextLine(File* file, char* line, size_t maxLength, size_t* length)
 {
     if (line == NULL || file == NULL || maxLength == 0 || file->mode != 'r')
         return NULL;
@@ -244,12 +947,15 @@ char* nextLine(File* file, char* line, size_t maxLength)
         return NULL;
 
     int currentChar = -1;
-    for (int i = 0; i < maxLength - 1; i++)
+    for (size_t i = 0; i < maxLength - 1; i++)
     {
         currentChar = nextChar(file);
         if (currentChar == '\n' || currentChar == FILE_END)
         {
             line[i] = STRING_TERMINATION;
+            if (length != NULL)
+                *length = i;
+
             return line;
         }
 
@@ -260,9 +966,480 @@ char* nextLine(File* file, char* line, size_t maxLength)
 }
 
 //-----------------------------------------------------------------------------
-//! Writes ch to file. ch is converted to unsigned int.
+//! Returns the current position in file (the offset of the next byte to be 
+//! read or written from the beginning of file).
 //!
-//! @param [in] file  pointer to the file to which ch is to be written
+//! @param [in] file  pointer to the file
+//!
+//! @return position in file or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int64_t tellFile(File* file)
+{
+    if (file == NULL || file->cfile == NULL)
+        return -1;
+
+    if (file->mode != 'r' && file->compressed != NULL)
+        return file->compressed->rawLength + (int64_t) file->compressed->rawUsed;
+
+    if (file->mode != 'r')
+        return (int64_t) ftello(file->cfile);
+
+    size_t position = file->position < file->correctBufferValues ? 
+                      file->position : file->correctBufferValues;
+
+    return file->bufferOffset + (int64_t) position;
+}
+
+//-----------------------------------------------------------------------------
+//! Moves the current position in file. If file is opened in 'r' mode and the
+//! new position is inside the data already loaded to the buffer of file then
+//! the buffer is reused.
+//!
+//! @param [in] file    pointer to the file
+//! @param [in] offset  offset from origin
+//! @param [in] origin  SEEK_FROM_BEGIN, SEEK_FROM_CURRENT or SEEK_FROM_END
+//!
+//! @note Files opened in 'a' mode are still always written at the end.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int seekFile(File* file, int64_t offset, int origin)
+{
+    if (file == NULL || file->cfile == NULL)
+        return -1;
+
+    int64_t target = offset;
+    switch (origin)
+    {
+        case SEEK_FROM_BEGIN:
+        break;
+
+        case SEEK_FROM_CURRENT:
+        target += tellFile(file);
+        break;
+
+        case SEEK_FROM_END:
+        {
+            if (file->compressed != NULL)
+            {
+                target += file->compressed->rawLength;
+                break;
+            }
+
+            if (file->mode != 'r' && fflush(file->cfile) != 0)
+                return -1;
+
+            struct stat fileStat = {};
+            if (fstat(fileno(file->cfile), &fileStat) != 0)
+                return -1;
+
+            target += (int64_t) fileStat.st_size;
+            break;
+        }
+
+        default:
+        return -1;
+    }
+
+    if (target < 0)
+        return -1;
+
+    // compressed files are written strictly sequentially
+    if (file->mode != 'r' && file->compressed != NULL)
+        return -1;
+
+    if (file->mode != 'r')
+        return fseeko(file->cfile, (off_t) target, SEEK_SET);
+
+    if (target >= file->bufferOffset && 
+        target <  file->bufferOffset + (int64_t) file->correctBufferValues)
+    {
+        file->position       = (size_t) (target - file->bufferOffset);
+        file->fileEndReached = 0;
+
+        return 0;
+    }
+
+    if (file->compressed != NULL)
+    {
+        if (seekCompressed(file, target) != 0)
+            return -1;
+    }
+    else if (fseeko(file->cfile, (off_t) target, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+
+    file->bufferOffset        = target;
+    file->position            = BUFFER_SIZE;
+    file->correctBufferValues = 0;
+    file->fileEndReached      = 0;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads up to length bytes starting from offset with pread until all of them
+//! are read, the end of file is reached or an error occurs.
+//!
+//! @return number of bytes read or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+ssize_t preadAll(int fd, int64_t offset, size_t length, unsigned char* destination)
+{
+    size_t bytesRead = 0;
+    while (bytesRead < length)
+    {
+        ssize_t result = pread(fd, destination + bytesRead, length - bytesRead, (off_t) offset + bytesRead);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return -1;
+        if (result == 0)
+            break;
+
+        bytesRead += (size_t) result;
+    }
+
+    return (ssize_t) bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+//! Returns the hash table slot for the block with number index of the file
+//! (device, inode).
+//-----------------------------------------------------------------------------
+CachedBlock** blockCacheSlot(BlockCache* cache, uint64_t device, uint64_t inode, int64_t index)
+{
+    assert(cache);
+
+    uint64_t hash = device * 0x9E3779B97F4A7C15ull ^ inode * 0xC2B2AE3D27D4EB4Full ^ (uint64_t) index;
+    hash ^= hash >> 29;
+
+    return &cache->table[hash & (cache->tableSize - 1)];
+}
+
+//-----------------------------------------------------------------------------
+//! Finds a block in cache and marks it as the most recently used one. 
+//! BLOCK_CACHE_MUTEX has to be locked.
+//!
+//! @return pointer to the block or NULL if it's not in cache.
+//-----------------------------------------------------------------------------
+CachedBlock* findCachedBlock(BlockCache* cache, uint64_t device, uint64_t inode, int64_t index)
+{
+    assert(cache);
+
+    CachedBlock* block = *blockCacheSlot(cache, device, inode, index);
+    while (block != NULL && 
+           (block->index != index || block->inode != inode || block->device != device))
+        block = block->hashNext;
+
+    if (block == NULL || block == cache->newest)
+        return block;
+
+    // move to the front of the LRU list
+    block->prev->next = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    else
+        cache->oldest = block->prev;
+
+    block->prev = NULL;
+    block->next = cache->newest;
+    cache->newest->prev = block;
+    cache->newest = block;
+
+    return block;
+}
+
+//-----------------------------------------------------------------------------
+//! Puts a block to cache evicting the least recently used one if cache is 
+//! full. BLOCK_CACHE_MUTEX has to be locked.
+//!
+//! @return pointer to the block inserted.
+//-----------------------------------------------------------------------------
+CachedBlock* insertCachedBlock(BlockCache* cache, uint64_t device, uint64_t inode, int64_t index,
+                               const unsigned char* data, size_t length)
+{
+    assert(cache);
+    assert(data);
+
+    CachedBlock* block = NULL;
+    if (cache->blocksUsed < cache->blocksCount)
+    {
+        block = &cache->blocks[cache->blocksUsed++];
+    }
+    else
+    {
+        block = cache->oldest;
+
+        CachedBlock** slot = blockCacheSlot(cache, block->device, block->inode, block->index);
+        while (*slot != block)
+            slot = &(*slot)->hashNext;
+        *slot = block->hashNext;
+
+        cache->oldest = block->prev;
+        if (cache->oldest != NULL)
+            cache->oldest->next = NULL;
+        else
+            cache->newest = NULL;
+    }
+
+    block->device = device;
+    block->inode  = inode;
+    block->index  = index;
+    block->length = length;
+    memcpy(block->data, data, length);
+
+    CachedBlock** slot = blockCacheSlot(cache, device, inode, index);
+    block->hashNext = *slot;
+    *slot = block;
+
+    block->prev = NULL;
+    block->next = cache->newest;
+    if (cache->newest != NULL)
+        cache->newest->prev = block;
+    else
+        cache->oldest = block;
+    cache->newest = block;
+
+    return block;
+}
+
+//-----------------------------------------------------------------------------
+//! Frees cache and all the blocks in it.
+//-----------------------------------------------------------------------------
+void destroyBlockCache(BlockCache* cache)
+{
+    if (cache == NULL)
+        return;
+
+    free(cache->blocks);
+    free(cache->storage);
+    free(cache->table);
+    free(cache);
+}
+
+//-----------------------------------------------------------------------------
+//! Sets up the block cache shared by all files for readAt. Blocks are 
+//! identified by the file (not the File) they belong to, so reopening a file
+//! doesn't invalidate its cached blocks. Previous contents of the cache are
+//! discarded.
+//!
+//! @param [in] blockSize    size of each block in bytes
+//! @param [in] blocksCount  max number of blocks in the cache, 0 to disable 
+//!                          the cache
+//!
+//! @note The cache assumes the files read with readAt aren't modified while 
+//!       their blocks are cached (use clearBlockCache if they are).
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int setBlockCache(size_t blockSize, size_t blocksCount)
+{
+    BlockCache* cache = NULL;
+    if (blocksCount > 0)
+    {
+        if (blockSize == 0)
+            return -1;
+
+        cache = (BlockCache*)calloc(1, sizeof(BlockCache));
+        if (cache == NULL)
+            return -1;
+
+        cache->blockSize   = blockSize;
+        cache->blocksCount = blocksCount;
+
+        cache->tableSize = 1;
+        while (cache->tableSize < 2 * blocksCount)
+            cache->tableSize *= 2;
+
+        cache->blocks  = (CachedBlock*)  calloc(blocksCount,      sizeof(CachedBlock));
+        cache->table   = (CachedBlock**) calloc(cache->tableSize, sizeof(CachedBlock*));
+        cache->storage = (unsigned char*)malloc(blocksCount * blockSize);
+        if (cache->blocks == NULL || cache->table == NULL || cache->storage == NULL)
+        {
+            destroyBlockCache(cache);
+            return -1;
+        }
+
+        for (size_t i = 0; i < blocksCount; i++)
+            cache->blocks[i].data = cache->storage + i * blockSize;
+    }
+
+    std::lock_guard<std::mutex> lock(BLOCK_CACHE_MUTEX);
+
+    destroyBlockCache(BLOCK_CACHE);
+    BLOCK_CACHE = cache;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Discards all the blocks in the block cache (e.g. after cached files have
+//! been modified) keeping its configuration.
+//-----------------------------------------------------------------------------
+void clearBlockCache()
+{
+    std::lock_guard<std::mutex> lock(BLOCK_CACHE_MUTEX);
+
+    BlockCache* cache = BLOCK_CACHE;
+    if (cache == NULL)
+        return;
+
+    cache->blocksUsed = 0;
+    cache->newest     = NULL;
+    cache->oldest     = NULL;
+    memset(cache->table, 0, cache->tableSize * sizeof(CachedBlock*));
+}
+
+//-----------------------------------------------------------------------------
+//! readAt through the block cache. Whether the cache is set up is checked 
+//! under BLOCK_CACHE_MUTEX for every block, if it isn't the rest is read
+//! directly from the file.
+//!
+//! @return number of bytes read or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+ssize_t readAtCached(File* file, int64_t offset, size_t length, unsigned char* destination)
+{
+    assert(file);
+    assert(destination);
+
+    int fd = fileno(file->cfile);
+
+    unsigned char* missed    = NULL;
+    size_t         bytesRead = 0;
+    while (bytesRead < length)
+    {
+        int64_t currentOffset = offset + (int64_t) bytesRead;
+
+        std::unique_lock<std::mutex> lock(BLOCK_CACHE_MUTEX);
+
+        BlockCache* cache = BLOCK_CACHE;
+        if (cache == NULL)
+        {
+            // the cache isn't set up or has been disabled meanwhile
+            lock.unlock();
+            free(missed);
+
+            ssize_t result = preadAll(fd, currentOffset, length - bytesRead, destination + bytesRead);
+            return result < 0 ? -1 : (ssize_t) bytesRead + result;
+        }
+
+        if (!file->identified)
+        {
+            lock.unlock();
+
+            struct stat fileStat = {};
+            if (fstat(fd, &fileStat) != 0)
+            {
+                free(missed);
+                return -1;
+            }
+
+            // other threads may read the same file, so the identity of file
+            // is only accessed under BLOCK_CACHE_MUTEX
+            lock.lock();
+            file->device     = (uint64_t) fileStat.st_dev;
+            file->inode      = (uint64_t) fileStat.st_ino;
+            file->identified = 1;
+            continue;
+        }
+
+        size_t  blockSize   = cache->blockSize;
+        int64_t index       = currentOffset / (int64_t) blockSize;
+        size_t  blockOffset = (size_t) (currentOffset % (int64_t) blockSize);
+
+        const unsigned char* data        = NULL;
+        size_t               blockLength = 0;
+
+        CachedBlock* block = findCachedBlock(cache, file->device, file->inode, index);
+        if (block != NULL)
+        {
+            data        = block->data;
+            blockLength = block->length;
+        }
+        else
+        {
+            lock.unlock();
+
+            unsigned char* newMissed = (unsigned char*)realloc(missed, blockSize);
+            if (newMissed == NULL)
+            {
+                free(missed);
+                return -1;
+            }
+            missed = newMissed;
+
+            ssize_t result = preadAll(fd, index * (int64_t) blockSize, blockSize, missed);
+            if (result < 0)
+            {
+                free(missed);
+                return -1;
+            }
+
+            data        = missed;
+            blockLength = (size_t) result;
+
+            lock.lock();
+            if (BLOCK_CACHE != NULL && BLOCK_CACHE->blockSize == blockSize &&
+                findCachedBlock(BLOCK_CACHE, file->device, file->inode, index) == NULL)
+                insertCachedBlock(BLOCK_CACHE, file->device, file->inode, index, missed, blockLength);
+        }
+
+        if (blockOffset >= blockLength)
+            break;
+
+        size_t toCopy = blockLength - blockOffset;
+        if (toCopy > length - bytesRead)
+            toCopy = length - bytesRead;
+
+        memcpy(destination + bytesRead, data + blockOffset, toCopy);
+        bytesRead += toCopy;
+
+        lock.unlock();
+
+        if (blockLength < blockSize)
+            break;
+    }
+
+    free(missed);
+
+    return (ssize_t) bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads length bytes starting from offset in file to destination without 
+//! changing the current position in file (so it can be used along with 
+//! nextChar, nextLine etc.). If the block cache is set up (see setBlockCache)
+//! the data is read through it.
+//!
+//! @param [in]  file         pointer to the file opened in 'r' mode
+//! @param [in]  offset       offset from the beginning of file
+//! @param [in]  length       number of bytes to read
+//! @param [out] destination  buffer to which to read
+//!
+//! @return number of bytes read (less than length only if the end of file 
+//!         has been reached) or FILE_END on failure.
+//-----------------------------------------------------------------------------
+size_t readAt(File* file, int64_t offset, size_t length, void* destination)
+{
+    if (file        == NULL ||
+        file->cfile == NULL ||
+        destination == NULL ||
+        offset      <  0    ||
+        file->mode  != 'r')
+        return FILE_END;
+
+    if (file->compressed != NULL)
+        return readCompressedAt(file, offset, length, (unsigned char*) destination);
+
+    ssize_t result = readAtCached(file, offset, length, (unsigned char*) destination);
+    return result < 0 ? FILE_END : (size_t) result;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes ch to file. ch is converted to unsigned int.
+//!
+//! @param [in] file  pointer to the file to which ch is to be written
 //! @param [in] ch    character to be written to file
 //!
 //! @return ch or FILE_END on failure.
@@ -274,8 +1451,41 @@ int writeChar(File* file, char ch)
         (file->mode != 'w' && file->mode != 'a'))
         return FILE_END;
 
+    if (file->compressed != NULL)
+        return writeBytes(file, &ch, 1) == 1 ? (unsigned char)ch : FILE_END;
+
     int result = putc((unsigned char)ch, file->cfile);
-    return result == (unsigned char)ch ? result : FILE_END;
+    if (result != (unsigned char)ch)
+        return FILE_END;
+
+    if (file->checksum != NULL)
+        updateChecksum(file->checksum, &ch, 1);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes bytesCount bytes from data to file. All writes to the C stream of
+//! file go through this function (or update the checksum of file 
+//! themselves).
+//!
+//! @return number of bytes written.
+//-----------------------------------------------------------------------------
+size_t writeBytes(File* file, const void* data, size_t bytesCount)
+{
+    assert(file);
+    assert(data);
+
+    size_t written = 0;
+    if (file->compressed != NULL)
+        written = writeCompressed(file, data, bytesCount);
+    else
+        written = fwrite(data, sizeof(char), bytesCount, file->cfile);
+
+    if (file->checksum != NULL)
+        updateChecksum(file->checksum, data, written);
+
+    return written;
 }
 
 //-----------------------------------------------------------------------------
@@ -294,9 +1504,9 @@ int writeString(File* file, const char* str)
         str == NULL)
         return FILE_END;
 
-    for (unsigned char* currentChar = (unsigned char*)str; *currentChar != STRING_TERMINATION; currentChar++)
-        if (writeChar(file, *currentChar) == FILE_END)
-            return FILE_END;
+    size_t length = strLength(str);
+    if (writeBytes(file, str, length) != length)
+        return FILE_END;
 
     return 0;
 }
@@ -317,9 +1527,9 @@ int writeLine(File* file, const char* line)
         line == NULL)
         return FILE_END;
 
-    for (unsigned char* currentChar = (unsigned char*)line; *currentChar != STRING_TERMINATION; currentChar++)
-        if (writeChar(file, *currentChar) == FILE_END)
-            return FILE_END;
+    size_t length = strLength(line);
+    if (writeBytes(file, line, length) != length)
+        return FILE_END;
 
     if (writeChar(file, '\n') == FILE_END)
         return FILE_END;
@@ -328,574 +1538,4362 @@ int writeLine(File* file, const char* line)
 }
 
 //-----------------------------------------------------------------------------
-//! Writes formatted string to file. All %c, %d and %s from str are changed to
-//! char, int or char* string equivalents of args from valist respectively. 
-//!
-//! @param [in] file    pointer to the file to which string is to be written
-//! @param [in] str     pointer to a string containing format in which specifying
-//!                     how to interpret the arguments from valist
-//! @param [in] valist  
+//! Makes the position of the C stream of file match the position of its file
+//! descriptor after the descriptor has been written to directly.
 //!
-//! @note The order of arguments from valist has to be the same as the order of
-//!       %c, %d or %s indicators in str.
-//!
-//! @return number of arguments successfully interpreted or -1 if an
-//!         error occurred.
+//! @return 0 on success and -1 if an error occurred.
 //-----------------------------------------------------------------------------
-int writeFormatted(File* file, const char* str, va_list valist)
+int syncStreamPosition(File* file)
 {
-    if (file        == NULL                      ||
-        file->cfile == NULL                      ||
-        (file->mode != 'w' && file->mode != 'a') ||
-        str         == NULL)
+    assert(file);
+
+    off_t position = lseek(fileno(file->cfile), 0, SEEK_CUR);
+    if (position < 0)
         return -1;
 
-    //=== for interpreting %d
-    int    successfullyInterpreted = 0;
-    int    intValue                = 0;
-    size_t digits                  = 0;
-    char*  convertedToStr          = NULL;
-    //===
-    for (char* currentChar = (char*)str; *currentChar != STRING_TERMINATION; currentChar++)
-    {
-        if (*currentChar == '%')
-        {
-            currentChar++;
+    return fseeko(file->cfile, position, SEEK_SET);
+}
 
-            switch (*currentChar)
-            {
-                case 'c':
-                if (writeChar(file, va_arg(valist, char)) == FILE_END)
-                {
-                    va_end(valist);
-                    return -1;
-                }
+//-----------------------------------------------------------------------------
+//! Writes all the vectors of writer with as few writev calls as possible and
+//! empties writer. Only the bytes actually written are added to the checksum
+//! of writer.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int flushGatherWriter(GatherWriter* writer)
+{
+    assert(writer);
 
-                successfullyInterpreted++;
-                break;
+    struct iovec* vectors      = writer->vectors;
+    int           vectorsCount = writer->vectorsCount;
 
-                case 'd':
-                intValue  = va_arg(valist, int);
-                digits = numberOfDigits(intValue);
-                digits = intValue < 0 ? digits + 1 : digits;
+    writer->vectorsCount = 0;
+    writer->stagingUsed  = 0;
 
-                convertedToStr = (char*) calloc(digits + 1, sizeof(char));
-                if (intToStr(intValue, convertedToStr, intValue < 0 ? digits - 1 : digits) == NULL ||
-                    writeString(file, convertedToStr) == FILE_END)
-                {
-                    free(convertedToStr);
-                    va_end(valist);
-                    return -1;
-                }
+    while (vectorsCount > 0)
+    {
+        ssize_t written = writev(writer->fd, vectors, vectorsCount);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
 
-                successfullyInterpreted++;
-                free(convertedToStr);
-                break;
+        // skip what has been written, partially written vector is adjusted
+        while (vectorsCount > 0 && (size_t) written >= vectors->iov_len)
+        {
+            if (writer->checksum != NULL)
+                updateChecksum(writer->checksum, vectors->iov_base, vectors->iov_len);
 
-                case 's':
-                if (writeString(file, va_arg(valist, char*)) == FILE_END)
-                {
-                    va_end(valist);
-                    return -1;
-                }
+            written -= (ssize_t) vectors->iov_len;
+            vectors++;
+            vectorsCount--;
+        }
 
-                successfullyInterpreted++;
-                break;
+        if (vectorsCount > 0)
+        {
+            if (writer->checksum != NULL)
+                updateChecksum(writer->checksum, vectors->iov_base, (size_t) written);
 
-                default:
-                if (writeChar(file, '%')          == FILE_END ||
-                    writeChar(file, *currentChar) == FILE_END)
-                {
-                    va_end(valist);
-                    return -1;
-                }
+            vectors->iov_base  = (char*) vectors->iov_base + written;
+            vectors->iov_len  -= (size_t) written;
+        }
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Adds bytesCount bytes from data to writer. Small fragments are copied to 
+//! the staging buffer of writer (and merged with neighbouring ones), large 
+//! ones are written later right from data.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int gather(GatherWriter* writer, const void* data, size_t bytesCount)
+{
+    assert(writer);
+    assert(data);
+
+    if (bytesCount == 0)
+        return 0;
+
+    if (writer->compressedFile != NULL)
+        return writeBytes(writer->compressedFile, data, bytesCount) == bytesCount ? 0 : -1;
+
+    if (bytesCount < GATHER_COPY_THRESHOLD)
+    {
+        if (writer->stagingUsed + bytesCount > GATHER_STAGING_SIZE &&
+            flushGatherWriter(writer) != 0)
+            return -1;
+
+        unsigned char* destination = writer->staging + writer->stagingUsed;
+        memcpy(destination, data, bytesCount);
+        writer->stagingUsed += bytesCount;
+
+        struct iovec* last = writer->vectorsCount > 0 ? &writer->vectors[writer->vectorsCount - 1] : NULL;
+        if (last != NULL && (unsigned char*) last->iov_base + last->iov_len == destination)
+        {
+            last->iov_len += bytesCount;
+            return 0;
+        }
+
+        if (writer->vectorsCount == GATHER_MAX_VECTORS)
+        {
+            // the staged bytes are moved to the beginning of staging
+            if (flushGatherWriter(writer) != 0)
+                return -1;
+
+            memmove(writer->staging, destination, bytesCount);
+            writer->stagingUsed = bytesCount;
+            destination         = writer->staging;
+        }
+
+        writer->vectors[writer->vectorsCount].iov_base = destination;
+        writer->vectors[writer->vectorsCount].iov_len  = bytesCount;
+        writer->vectorsCount++;
+
+        return 0;
+    }
+
+    if (writer->vectorsCount == GATHER_MAX_VECTORS &&
+        flushGatherWriter(writer) != 0)
+        return -1;
+
+    writer->vectors[writer->vectorsCount].iov_base = (void*) data;
+    writer->vectors[writer->vectorsCount].iov_len  = bytesCount;
+    writer->vectorsCount++;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Prepares writer for gathered writes to file. Data previously written to 
+//! file is flushed first so that the order of writes is preserved. Writer 
+//! uses the staging buffer of the current thread, which is allocated once.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int openGatherWriter(GatherWriter* writer, File* file)
+{
+    assert(writer);
+    assert(file);
+
+    if (fflush(file->cfile) != 0)
+        return -1;
+
+    if (GATHER_STAGING.buffer == NULL)
+        GATHER_STAGING.buffer = (unsigned char*)malloc(GATHER_STAGING_SIZE);
+
+    writer->staging = GATHER_STAGING.buffer;
+    if (writer->staging == NULL)
+        return -1;
+
+    writer->fd           = fileno(file->cfile);
+    writer->checksum     = file->checksum;
+    writer->vectorsCount = 0;
+
+    // compressed data can't be written directly, it's passed to writeBytes
+    writer->compressedFile = file->compressed != NULL ? file : NULL;
+    writer->stagingUsed  = 0;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes everything left in writer and synchronizes the C stream of file 
+//! with the writes made.
+//!
+//! @param [in] succeeded  0 if writes to writer failed, in which case the
+//!                        data left isn't written
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int closeGatherWriter(GatherWriter* writer, File* file, int succeeded)
+{
+    assert(writer);
+    assert(file);
+
+    if (succeeded && flushGatherWriter(writer) != 0)
+        succeeded = 0;
+
+    writer->staging = NULL;
+
+    if (file->compressed == NULL && syncStreamPosition(file) != 0)
+        succeeded = 0;
+
+    return succeeded ? 0 : FILE_END;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes count data fragments to file one after another. Large fragments are
+//! written directly from the caller's memory with writev, small ones are 
+//! merged in a staging buffer first, so the whole call takes just a few 
+//! system calls.
+//!
+//! @param [in] file     pointer to the file to which data is to be written
+//! @param [in] vectors  fragments to be written
+//! @param [in] count    number of fragments
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int writeGathered(File* file, const IoVector* vectors, size_t count)
+{
+    if (file == NULL                             ||
+        file->cfile == NULL                      ||
+        (file->mode != 'w' && file->mode != 'a') ||
+        (vectors == NULL && count > 0))
+        return FILE_END;
+
+    GatherWriter writer;
+    if (openGatherWriter(&writer, file) != 0)
+        return FILE_END;
+
+    int succeeded = 1;
+    for (size_t i = 0; i < count && succeeded; i++)
+    {
+        if ((vectors[i].data == NULL && vectors[i].length > 0) ||
+            gather(&writer, vectors[i].data, vectors[i].length) != 0)
+            succeeded = 0;
+    }
+
+    return closeGatherWriter(&writer, file, succeeded);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes count lines to file adding '\n' after each of them. Works the same
+//! way as writeGathered does, so it's much faster than count calls of 
+//! writeLine.
+//!
+//! @param [in] file   pointer to the file to which lines are to be written
+//! @param [in] lines  lines to be written
+//! @param [in] count  number of lines
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int writeLines(File* file, const char* const* lines, size_t count)
+{
+    if (file == NULL                             ||
+        file->cfile == NULL                      ||
+        (file->mode != 'w' && file->mode != 'a') ||
+        (lines == NULL && count > 0))
+        return FILE_END;
+
+    GatherWriter writer;
+    if (openGatherWriter(&writer, file) != 0)
+        return FILE_END;
+
+    const char newLine = '\n';
+
+    int succeeded = 1;
+    for (size_t i = 0; i < count && succeeded; i++)
+    {
+        if (lines[i] == NULL                                   ||
+            gather(&writer, lines[i], strLength(lines[i])) != 0 ||
+            gather(&writer, &newLine, 1) != 0)
+            succeeded = 0;
+    }
+
+    return closeGatherWriter(&writer, file, succeeded);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes bytesCount bytes from source to fd until all of them are written or
+//! an error occurs.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int writeAll(int fd, const unsigned char* source, size_t bytesCount)
+{
+    while (bytesCount > 0)
+    {
+        ssize_t written = write(fd, source, bytesCount);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+
+        source     += written;
+        bytesCount -= (size_t) written;
+    }
+
+    return 0;
+}
+
+#ifdef __linux__
+//-----------------------------------------------------------------------------
+//! Moves up to bytesCount bytes from inFd (starting from offset) to the 
+//! current position of outFd through the pipe pipeFds with splice, so the 
+//! data never leaves the kernel. If the data can't be spliced out of the 
+//! pipe, what's in the pipe is written to outFd through user space, so 
+//! nothing is lost.
+//!
+//! @return number of bytes moved, 0 at the end of the input, -1 if nothing 
+//!         has been moved and -2 if the data taken from inFd couldn't be
+//!         written.
+//-----------------------------------------------------------------------------
+ssize_t spliceThroughPipe(int inFd, int outFd, const int pipeFds[2], int64_t offset, size_t bytesCount)
+{
+    loff_t  inOffset = (loff_t) offset;
+    ssize_t inPipe   = splice(inFd, &inOffset, pipeFds[1], NULL, bytesCount, SPLICE_F_MOVE);
+    if (inPipe <= 0)
+        return inPipe;
+
+    size_t left = (size_t) inPipe;
+    while (left > 0)
+    {
+        ssize_t result = splice(pipeFds[0], NULL, outFd, NULL, left, SPLICE_F_MOVE);
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result <= 0)
+            break;
+
+        left -= (size_t) result;
+    }
+
+    if (left == 0)
+        return inPipe;
+
+    unsigned char* rest = (unsigned char*)malloc(left);
+    if (rest == NULL)
+        return -2;
+
+    size_t restRead = 0;
+    while (restRead < left)
+    {
+        ssize_t result = read(pipeFds[0], rest + restRead, left - restRead);
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result <= 0)
+            break;
+
+        restRead += (size_t) result;
+    }
+
+    int failed = restRead != left || writeAll(outFd, rest, left) != 0;
+    free(rest);
+
+    return failed ? -2 : inPipe;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+//! Copies up to length bytes from inFd (starting from offset, which is 
+//! advanced) to the current position of outFd inside the kernel. 
+//! copy_file_range is tried first, then sendfile and then splice through a
+//! pipe, each one taking over when the previous one fails.
+//!
+//! @return number of bytes copied, which is less than length if the end of
+//!         the input has been reached or the kernel can't copy between these
+//!         descriptors (then the rest has to be copied some other way), or
+//!         -1 if data has been lost on the way.
+//-----------------------------------------------------------------------------
+int64_t copyInKernel(int inFd, int outFd, int outAppends, int64_t* offset, int64_t length)
+{
+    assert(offset);
+
+    int64_t copied = 0;
+
+#ifdef __linux__
+    // none of copy_file_range, sendfile and splice can write to an O_APPEND
+    // descriptor (they fail with EBADF or EINVAL), so appending destinations
+    // are left to be copied through user space
+    if (outAppends)
+        return 0;
+
+    enum { USE_COPY_FILE_RANGE, USE_SENDFILE, USE_SPLICE, USE_NOTHING };
+
+    int    method     = USE_COPY_FILE_RANGE;
+    int    pipeFds[2] = {-1, -1};
+    size_t pipeSize   = 0;
+    while (copied < length && method != USE_NOTHING)
+    {
+        size_t  chunk    = length - copied < (int64_t) SSIZE_MAX ? (size_t) (length - copied) : SSIZE_MAX;
+        off_t   inOffset = (off_t) *offset;
+        ssize_t result   = -1;
+
+        if (method == USE_COPY_FILE_RANGE)
+        {
+            result = copy_file_range(inFd, &inOffset, outFd, NULL, chunk, 0);
+        }
+        else if (method == USE_SENDFILE)
+        {
+            result = sendfile(outFd, inFd, &inOffset, chunk);
+        }
+        else
+        {
+            if (pipeFds[0] < 0)
+            {
+                if (pipe2(pipeFds, O_CLOEXEC) != 0)
+                    break;
+
+                int size = fcntl(pipeFds[1], F_SETPIPE_SZ, (int) COPY_BUFFER_SIZE);
+                if (size <= 0)
+                    size = fcntl(pipeFds[1], F_GETPIPE_SZ);
+                pipeSize = size > 0 ? (size_t) size : BUFFER_SIZE;
+            }
+
+            result = spliceThroughPipe(inFd, outFd, pipeFds, *offset, chunk < pipeSize ? chunk : pipeSize);
+            if (result == -2)
+            {
+                copied = -1;
                 break;
             }
         }
-        else if (writeChar(file, *currentChar) == FILE_END)
+
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+        {
+            method++;
+            continue;
+        }
+        if (result == 0)
+            break;
+
+        *offset += result;
+        copied  += result;
+    }
+
+    if (pipeFds[0] >= 0)
+    {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+    }
+#endif
+
+    return copied;
+}
+
+//-----------------------------------------------------------------------------
+//! Copies length bytes of source starting from offset to the current 
+//! position of destination when at least one of them is compressed, so the
+//! data has to go through readAt and writeBytes.
+//!
+//! @return number of bytes copied or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int64_t transferCompressed(File* source, File* destination, int64_t offset, int64_t length,
+                           Checksum* sourceChecksum)
+{
+    assert(source);
+    assert(destination);
+
+    unsigned char* buffer = (unsigned char*)malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+        return -1;
+
+    int64_t copied = 0;
+    while (copied < length)
+    {
+        size_t chunk     = length - copied < (int64_t) COPY_BUFFER_SIZE ? (size_t) (length - copied) : COPY_BUFFER_SIZE;
+        size_t bytesRead = readAt(source, offset, chunk, buffer);
+        if (bytesRead == (size_t) FILE_END || writeBytes(destination, buffer, bytesRead) != bytesRead)
         {
-            va_end(valist);
+            free(buffer);
             return -1;
         }
+
+        if (sourceChecksum != NULL)
+            updateChecksum(sourceChecksum, buffer, bytesRead);
+
+        offset += (int64_t) bytesRead;
+        copied += (int64_t) bytesRead;
+
+        if (bytesRead < chunk)
+            break;
     }
 
-    va_end(valist);
+    free(buffer);
+
+    return copied;
+}
+
+//-----------------------------------------------------------------------------
+//! Copies length bytes of source starting from offset to the current 
+//! position of destination. If neither file computes a checksum the data is
+//! copied inside the kernel when possible.
+//!
+//! @param [in] sourceChecksum  checksum to be updated with the data read or
+//!                             NULL
+//!
+//! @return number of bytes copied or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int64_t transferFileRange(File* source, File* destination, int64_t offset, int64_t length,
+                          Checksum* sourceChecksum)
+{
+    if (source             == NULL ||
+        source->cfile      == NULL ||
+        source->mode       != 'r'  ||
+        destination        == NULL ||
+        destination->cfile == NULL ||
+        (destination->mode != 'w' && destination->mode != 'a') ||
+        offset < 0 || length < 0)
+        return -1;
+
+    if (source->compressed != NULL || destination->compressed != NULL)
+        return transferCompressed(source, destination, offset, length, sourceChecksum);
+
+    if (fflush(destination->cfile) != 0)
+        return -1;
+
+    int inFd  = fileno(source->cfile);
+    int outFd = fileno(destination->cfile);
+
+    int64_t copied = 0;
+    if (sourceChecksum == NULL && destination->checksum == NULL)
+        copied = copyInKernel(inFd, outFd, destination->mode == 'a', &offset, length);
+
+    if (copied < 0)
+    {
+        syncStreamPosition(destination);
+        return -1;
+    }
+
+    if (copied < length)
+    {
+        unsigned char* buffer = (unsigned char*)malloc(COPY_BUFFER_SIZE);
+        if (buffer == NULL)
+        {
+            syncStreamPosition(destination);
+            return -1;
+        }
+
+        while (copied < length)
+        {
+            size_t  chunk     = length - copied < (int64_t) COPY_BUFFER_SIZE ? (size_t) (length - copied) : COPY_BUFFER_SIZE;
+            ssize_t bytesRead = preadAll(inFd, offset, chunk, buffer);
+            if (bytesRead < 0 || writeAll(outFd, buffer, (size_t) bytesRead) != 0)
+            {
+                free(buffer);
+                syncStreamPosition(destination);
+                return -1;
+            }
+
+            if (sourceChecksum != NULL)
+                updateChecksum(sourceChecksum, buffer, (size_t) bytesRead);
+            if (destination->checksum != NULL)
+                updateChecksum(destination->checksum, buffer, (size_t) bytesRead);
+
+            offset += bytesRead;
+            copied += bytesRead;
+
+            if ((size_t) bytesRead < chunk)
+                break;
+        }
+
+        free(buffer);
+    }
+
+    if (syncStreamPosition(destination) != 0)
+        return -1;
+
+    return copied;
+}
+
+//-----------------------------------------------------------------------------
+//! Copies length bytes of source starting from offset to the current 
+//! position of destination. The data is copied inside the kernel 
+//! (copy_file_range, sendfile or splice) when possible and through a large 
+//! buffer otherwise. The current position of source doesn't change.
+//!
+//! @note The kernel can't copy to files opened in 'a' mode, so they are 
+//!       always copied through the buffer.
+//!
+//! @param [in] source       pointer to the file opened in 'r' mode
+//! @param [in] destination  pointer to the file opened in 'w' or 'a' mode
+//! @param [in] offset       offset in source from which to copy
+//! @param [in] length       number of bytes to copy
+//!
+//! @note Everything previously written to destination with other ioLib 
+//!       functions is written before the copied data.
+//!
+//! @return number of bytes copied (less than length only if the end of 
+//!         source has been reached) or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int64_t copyFileRange(File* source, File* destination, int64_t offset, int64_t length)
+{
+    return transferFileRange(source, destination, offset, length, NULL);
+}
+
+//-----------------------------------------------------------------------------
+//! Appends everything from source that hasn't been read yet to destination
+//! and moves source to its end. See copyFileRange for details.
+//!
+//! @param [in] destination  pointer to the file opened in 'w' or 'a' mode
+//! @param [in] source       pointer to the file opened in 'r' mode
+//!
+//! @return number of bytes copied or -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int64_t appendFile(File* destination, File* source)
+{
+    if (source             == NULL ||
+        source->mode       != 'r'  ||
+        destination        == NULL ||
+        destination->cfile == NULL ||
+        (destination->mode != 'w' && destination->mode != 'a'))
+        return -1;
+
+    // the data already loaded to the buffer of source is taken from there
+    int64_t copied = 0;
+    if (source->position < source->correctBufferValues)
+    {
+        size_t buffered = source->correctBufferValues - source->position;
+        if (writeBytes(destination, source->buffer + source->position, buffered) != buffered)
+            return -1;
+
+        source->position = source->correctBufferValues;
+        copied = (int64_t) buffered;
+    }
+
+    int64_t start = tellFile(source);
+    if (start < 0)
+        return -1;
+
+    int64_t transferred = transferFileRange(source, destination, start, INT64_MAX - start, 
+                                            source->checksum);
+    if (transferred < 0)
+        return -1;
+
+    if (seekFile(source, start + transferred, SEEK_FROM_BEGIN) != 0)
+        return -1;
+
+    return copied + transferred;
+}
+
+//-----------------------------------------------------------------------------
+//! @return index of the latency histogram bucket for microseconds.
+//-----------------------------------------------------------------------------
+size_t latencyBucket(uint64_t microseconds)
+{
+    if (microseconds < LATENCY_SUB_BUCKETS)
+        return (size_t) microseconds;
+
+    size_t powerOfTwo = 63 - __builtin_clzll(microseconds);
+    size_t subBucket  = (size_t) (microseconds >> (powerOfTwo - 3)) & (LATENCY_SUB_BUCKETS - 1);
+
+    size_t bucket = LATENCY_SUB_BUCKETS * (powerOfTwo - 2) + subBucket;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+//-----------------------------------------------------------------------------
+//! @return the largest number of microseconds that belongs to bucket.
+//-----------------------------------------------------------------------------
+uint64_t latencyBucketLimit(size_t bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    size_t powerOfTwo = bucket / LATENCY_SUB_BUCKETS + 2;
+    size_t subBucket  = bucket % LATENCY_SUB_BUCKETS;
+
+    return ((uint64_t) (LATENCY_SUB_BUCKETS + subBucket + 1) << (powerOfTwo - 3)) - 1;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes everything written to file so far to the disk (fflush + 
+//! fdatasync) and measures how long it took.
+//!
+//! @param [out] microseconds  duration of the synchronization
+//! @param [out] offset        size of the data synchronized
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int syncFileData(File* file, uint64_t* microseconds, int64_t* offset)
+{
+    assert(file);
+    assert(microseconds);
+    assert(offset);
+
+    auto start = std::chrono::steady_clock::now();
+
+    int result = fflush(file->cfile) == 0 ? 0 : -1;
+    *offset = (int64_t) ftello(file->cfile);
+
+    if (result == 0 && fdatasync(fileno(file->cfile)) != 0)
+        result = -1;
+
+    auto duration = std::chrono::steady_clock::now() - start;
+    *microseconds = (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Accounts a synchronization that took microseconds in the latency stats of
+//! durability. durability->mutex has to be locked.
+//-----------------------------------------------------------------------------
+void countSync(Durability* durability, uint64_t microseconds)
+{
+    assert(durability);
+
+    durability->syncsCount++;
+    durability->latencies[latencyBucket(microseconds)]++;
+
+    if (microseconds > durability->maxLatency)
+        durability->maxLatency = microseconds;
+}
+
+//-----------------------------------------------------------------------------
+//! Sets how records written to file are made durable (see commitRecord).
+//!
+//! @param [in] file               pointer to the file opened in 'w' or 'a' 
+//!                                mode
+//! @param [in] policy             DURABILITY_NONE       - nothing is done;
+//!                                DURABILITY_PER_RECORD - each record is 
+//!                                                        synchronized with
+//!                                                        the disk;
+//!                                DURABILITY_GROUP_COMMIT - records are 
+//!                                  synchronized in groups when the first 
+//!                                  record of the group is groupMilliseconds
+//!                                  old or groupBytes have been written
+//! @param [in] groupMilliseconds  max time a record waits for its group
+//! @param [in] groupBytes         max size of a group
+//!
+//! @note Not supported for compressed files.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int setDurabilityPolicy(File* file, int policy, unsigned int groupMilliseconds, size_t groupBytes)
+{
+    if (file        == NULL ||
+        file->cfile == NULL ||
+        file->compressed != NULL ||
+        (file->mode != 'w' && file->mode != 'a'))
+        return -1;
+
+    if (policy != DURABILITY_NONE       &&
+        policy != DURABILITY_PER_RECORD &&
+        policy != DURABILITY_GROUP_COMMIT)
+        return -1;
+
+    if (file->durability == NULL)
+    {
+        file->durability = new (std::nothrow) Durability;
+        if (file->durability == NULL)
+            return -1;
+
+        file->durability->syncedOffset = (int64_t) ftello(file->cfile);
+    }
+
+    Durability* durability = file->durability;
+    std::lock_guard<std::mutex> lock(durability->mutex);
+
+    durability->policy        = policy;
+    durability->groupInterval = std::chrono::milliseconds(groupMilliseconds);
+    durability->groupBytes    = groupBytes;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Marks the end of a record written to file and waits until the record is 
+//! durable according to the durability policy of file. Can be called from
+//! several threads writing to the same file, in which case under 
+//! DURABILITY_GROUP_COMMIT one of them synchronizes the file with the disk
+//! for the whole group while the others wait for it.
+//!
+//! @param [in] file  pointer to the file
+//!
+//! @return 0 on success and -1 if an error occurred (after a failed 
+//!         synchronization all the following commits fail as well).
+//-----------------------------------------------------------------------------
+int commitRecord(File* file)
+{
+    if (file == NULL || file->cfile == NULL)
+        return -1;
+
+    Durability* durability = file->durability;
+    if (durability == NULL)
+        return 0;
+
+    std::unique_lock<std::mutex> lock(durability->mutex);
+
+    if (durability->policy == DURABILITY_NONE)
+        return 0;
+
+    uint64_t ticket = ++durability->recordsCommitted;
+
+    if (durability->policy == DURABILITY_PER_RECORD)
+    {
+        lock.unlock();
+
+        uint64_t microseconds = 0;
+        int64_t  offset       = 0;
+        int      result       = syncFileData(file, &microseconds, &offset);
+
+        lock.lock();
+        countSync(durability, microseconds);
+        if (result != 0)
+            durability->syncFailed = 1;
+        else if (ticket > durability->recordsSynced)
+            durability->recordsSynced = ticket;
+
+        return durability->syncFailed ? -1 : 0;
+    }
+
+    if (ticket == durability->recordsSynced + 1)
+        durability->groupStart = std::chrono::steady_clock::now();
+
+    while (durability->recordsSynced < ticket && !durability->syncFailed)
+    {
+        if (durability->syncing)
+        {
+            durability->synced.wait(lock);
+            continue;
+        }
+
+        auto   deadline     = durability->groupStart + durability->groupInterval;
+        size_t pendingBytes = (size_t) ((int64_t) ftello(file->cfile) - durability->syncedOffset);
+
+        if (std::chrono::steady_clock::now() < deadline && pendingBytes < durability->groupBytes)
+        {
+            durability->synced.wait_until(lock, deadline);
+            continue;
+        }
+
+        // this thread synchronizes the whole group
+        uint64_t lastInGroup = durability->recordsCommitted;
+        durability->syncing  = 1;
+        lock.unlock();
+
+        uint64_t microseconds = 0;
+        int64_t  offset       = 0;
+        int      result       = syncFileData(file, &microseconds, &offset);
+
+        lock.lock();
+        countSync(durability, microseconds);
+        if (result != 0)
+        {
+            durability->syncFailed = 1;
+        }
+        else
+        {
+            durability->recordsSynced = lastInGroup;
+            durability->syncedOffset  = offset;
+        }
+
+        durability->syncing    = 0;
+        durability->groupStart = std::chrono::steady_clock::now();
+        durability->synced.notify_all();
+    }
+
+    return durability->syncFailed ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Fills stats with the number of records committed to file and latency
+//! percentiles of synchronizations with the disk made for them (values are
+//! rounded up with an error less than 12.5%).
+//!
+//! @param [in]  file   pointer to the file
+//! @param [out] stats  
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int getDurabilityStats(File* file, DurabilityStats* stats)
+{
+    if (file == NULL || stats == NULL)
+        return -1;
+
+    *stats = {};
+
+    Durability* durability = file->durability;
+    if (durability == NULL)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(durability->mutex);
+
+    stats->recordsCount    = (size_t) durability->recordsCommitted;
+    stats->syncsCount      = durability->syncsCount;
+    stats->maxMicroseconds = durability->maxLatency;
+
+    const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t*    results[]     = { &stats->p50Microseconds, &stats->p90Microseconds,
+                                   &stats->p99Microseconds, &stats->p999Microseconds };
+
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        size_t rank    = (size_t) ceil(percentiles[i] * (double) durability->syncsCount);
+        size_t counted = 0;
+        for (size_t bucket = 0; bucket < LATENCY_BUCKETS && rank > 0; bucket++)
+        {
+            counted += durability->latencies[bucket];
+            if (counted >= rank)
+            {
+                uint64_t limit = latencyBucketLimit(bucket);
+                *results[i] = limit < durability->maxLatency ? limit : durability->maxLatency;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! @return table for computing CRC32C one byte at a time.
+//-----------------------------------------------------------------------------
+const uint32_t* crc32cTable()
+{
+    static uint32_t table[256] = {};
+    static std::once_flag tableFilled;
+
+    std::call_once(tableFilled, []()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+
+            table[i] = crc;
+        }
+    });
+
+    return table;
+}
+
+#ifdef __x86_64__
+//-----------------------------------------------------------------------------
+//! Updates crc with bytesCount bytes from data using the SSE4.2 crc32 
+//! instruction.
+//-----------------------------------------------------------------------------
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t bytesCount)
+{
+    uint64_t crc64 = crc;
+    for (; bytesCount >= sizeof(uint64_t); bytesCount -= sizeof(uint64_t), data += sizeof(uint64_t))
+    {
+        uint64_t value = 0;
+        memcpy(&value, data, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+
+    crc = (uint32_t) crc64;
+    for (; bytesCount > 0; bytesCount--, data++)
+        crc = _mm_crc32_u8(crc, *data);
+
+    return crc;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+//! Updates crc (not inverted) with bytesCount bytes from data.
+//-----------------------------------------------------------------------------
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t bytesCount)
+{
+#ifdef __x86_64__
+    static const int hasSse42 = __builtin_cpu_supports("sse4.2");
+    if (hasSse42)
+        return crc32cHardware(crc, data, bytesCount);
+#endif
+
+    const uint32_t* table = crc32cTable();
+    for (; bytesCount > 0; bytesCount--, data++)
+        crc = table[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ull;
+constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+inline uint64_t rotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t xxh64Round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH_PRIME64_2;
+    accumulator  = rotateLeft(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+}
+
+inline uint64_t xxh64Merge(uint64_t accumulator, uint64_t lane)
+{
+    accumulator ^= xxh64Round(0, lane);
+    return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// integers in XXH64 input and in compressed files are little-endian
+// regardless of the byte order of the machine
+inline uint64_t read64(const unsigned char* data)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | data[i];
+
+    return value;
+}
+
+inline uint32_t read32(const unsigned char* data)
+{
+    return (uint32_t) data[0]         | ((uint32_t) data[1] << 8) | 
+           ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+inline void write64(unsigned char* data, uint64_t value)
+{
+    for (int i = 0; i < 8; i++, value >>= 8)
+        data[i] = (unsigned char) value;
+}
+
+inline void write32(unsigned char* data, uint32_t value)
+{
+    for (int i = 0; i < 4; i++, value >>= 8)
+        data[i] = (unsigned char) value;
+}
+
+//-----------------------------------------------------------------------------
+//! Initializes state for computing XXH64 with seed 0.
+//-----------------------------------------------------------------------------
+void xxh64Init(Xxh64State* state)
+{
+    assert(state);
+
+    *state = {};
+    state->lanes[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->lanes[1] = XXH_PRIME64_2;
+    state->lanes[2] = 0;
+    state->lanes[3] = 0 - XXH_PRIME64_1;
+}
+
+//-----------------------------------------------------------------------------
+//! Updates state with bytesCount bytes from data. Stripes of 32 bytes are 
+//! processed by 4 independent lanes, so they run in parallel on the CPU.
+//-----------------------------------------------------------------------------
+void xxh64Update(Xxh64State* state, const unsigned char* data, size_t bytesCount)
+{
+    assert(state);
+
+    state->totalLength += bytesCount;
+
+    if (state->memoryUsed + bytesCount < sizeof(state->memory))
+    {
+        memcpy(state->memory + state->memoryUsed, data, bytesCount);
+        state->memoryUsed += bytesCount;
+        return;
+    }
+
+    if (state->memoryUsed > 0)
+    {
+        size_t toFill = sizeof(state->memory) - state->memoryUsed;
+        memcpy(state->memory + state->memoryUsed, data, toFill);
+
+        for (int lane = 0; lane < 4; lane++)
+            state->lanes[lane] = xxh64Round(state->lanes[lane], read64(state->memory + 8 * lane));
+
+        data       += toFill;
+        bytesCount -= toFill;
+        state->memoryUsed = 0;
+    }
+
+    uint64_t lane0 = state->lanes[0];
+    uint64_t lane1 = state->lanes[1];
+    uint64_t lane2 = state->lanes[2];
+    uint64_t lane3 = state->lanes[3];
+    for (; bytesCount >= 32; bytesCount -= 32, data += 32)
+    {
+        lane0 = xxh64Round(lane0, read64(data));
+        lane1 = xxh64Round(lane1, read64(data + 8));
+        lane2 = xxh64Round(lane2, read64(data + 16));
+        lane3 = xxh64Round(lane3, read64(data + 24));
+    }
+    state->lanes[0] = lane0;
+    state->lanes[1] = lane1;
+    state->lanes[2] = lane2;
+    state->lanes[3] = lane3;
+
+    memcpy(state->memory, data, bytesCount);
+    state->memoryUsed = bytesCount;
+}
+
+//-----------------------------------------------------------------------------
+//! @return XXH64 of all the data state has been updated with.
+//-----------------------------------------------------------------------------
+uint64_t xxh64Digest(const Xxh64State* state)
+{
+    assert(state);
+
+    uint64_t hash = 0;
+    if (state->totalLength >= 32)
+    {
+        hash = rotateLeft(state->lanes[0], 1)  + rotateLeft(state->lanes[1], 7) +
+               rotateLeft(state->lanes[2], 12) + rotateLeft(state->lanes[3], 18);
+
+        for (int lane = 0; lane < 4; lane++)
+            hash = xxh64Merge(hash, state->lanes[lane]);
+    }
+    else
+    {
+        hash = XXH_PRIME64_5;
+    }
+
+    hash += state->totalLength;
+
+    const unsigned char* data = state->memory;
+    const unsigned char* end  = state->memory + state->memoryUsed;
+    for (; data + 8 <= end; data += 8)
+    {
+        hash ^= xxh64Round(0, read64(data));
+        hash  = rotateLeft(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (data + 4 <= end)
+    {
+        hash ^= (uint64_t) read32(data) * XXH_PRIME64_1;
+        hash  = rotateLeft(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        data += 4;
+    }
+
+    for (; data < end; data++)
+    {
+        hash ^= *data * XXH_PRIME64_5;
+        hash  = rotateLeft(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+//-----------------------------------------------------------------------------
+//! Updates checksum with bytesCount bytes from data.
+//-----------------------------------------------------------------------------
+void updateChecksum(Checksum* checksum, const void* data, size_t bytesCount)
+{
+    assert(checksum);
+
+    if (checksum->type == CHECKSUM_CRC32C)
+        checksum->crc = crc32c(checksum->crc, (const unsigned char*) data, bytesCount);
+    else if (checksum->type == CHECKSUM_XXHASH64)
+        xxh64Update(&checksum->xxh, (const unsigned char*) data, bytesCount);
+}
+
+//-----------------------------------------------------------------------------
+//! Makes file compute a checksum of all the data read from it (as the 
+//! buffer of file is loaded) or written to it.
+//!
+//! @param [in] file  pointer to the file
+//! @param [in] type  CHECKSUM_CRC32C, CHECKSUM_XXHASH64 or CHECKSUM_NONE to
+//!                   stop computing the checksum
+//!
+//! @note The checksum is reset, so typically it's set right after the file
+//!       is opened. It describes the data in the order it passes through 
+//!       the file, so it's meaningless if seekFile is used. Data read with
+//!       readAt or copyFileRange isn't included.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int setFileChecksum(File* file, int type)
+{
+    if (file == NULL)
+        return -1;
+
+    if (type != CHECKSUM_NONE && type != CHECKSUM_CRC32C && type != CHECKSUM_XXHASH64)
+        return -1;
+
+    if (type == CHECKSUM_NONE)
+    {
+        free(file->checksum);
+        file->checksum = NULL;
+        return 0;
+    }
+
+    if (file->checksum == NULL)
+    {
+        file->checksum = (Checksum*)calloc(1, sizeof(Checksum));
+        if (file->checksum == NULL)
+            return -1;
+    }
+
+    file->checksum->type = type;
+    file->checksum->crc  = 0xFFFFFFFFu;
+    xxh64Init(&file->checksum->xxh);
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Makes closeFile check that the checksum of file is equal to expected.
+//!
+//! @param [in] file      pointer to the file with a checksum set 
+//!                       (see setFileChecksum)
+//! @param [in] expected  expected value of the checksum
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int verifyFileChecksum(File* file, uint64_t expected)
+{
+    if (file == NULL || file->checksum == NULL)
+        return -1;
+
+    file->checksum->verifyOnClose = 1;
+    file->checksum->expected      = expected;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in] file  pointer to the file with a checksum set 
+//!                   (see setFileChecksum)
+//!
+//! @return checksum of the data that has passed through file so far or 0 if
+//!         file doesn't compute a checksum.
+//-----------------------------------------------------------------------------
+uint64_t getFileChecksum(File* file)
+{
+    if (file == NULL || file->checksum == NULL)
+        return 0;
+
+    if (file->checksum->type == CHECKSUM_CRC32C)
+        return ~file->checksum->crc;
+
+    return xxh64Digest(&file->checksum->xxh);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes length of literals or match that doesn't fit into 4 bits of the 
+//! token in the LZ4 manner (as a sequence of bytes 255 ended with a smaller
+//! one).
+//-----------------------------------------------------------------------------
+unsigned char* lzWriteLength(unsigned char* output, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *output++ = 255;
+
+    *output++ = (unsigned char) length;
+
+    return output;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes a sequence (literals followed by a match) in the LZ4 block format.
+//! If matchLength is 0 only literals are written (the last sequence).
+//!
+//! @return pointer to the byte after the sequence or NULL if it doesn't fit
+//!         into output.
+//-----------------------------------------------------------------------------
+unsigned char* lzWriteSequence(unsigned char* output, const unsigned char* outputEnd,
+                               const unsigned char* literals, size_t literalsLength,
+                               size_t offset, size_t matchLength)
+{
+    size_t worstCase = 1 + literalsLength / 255 + 1 + literalsLength + 2 + matchLength / 255 + 1;
+    if ((size_t) (outputEnd - output) < worstCase)
+        return NULL;
+
+    unsigned char* token = output++;
+    *token = (unsigned char) ((literalsLength < 15 ? literalsLength : 15) << 4);
+    if (literalsLength >= 15)
+        output = lzWriteLength(output, literalsLength - 15);
+
+    memcpy(output, literals, literalsLength);
+    output += literalsLength;
+
+    if (matchLength == 0)
+        return output;
+
+    *output++ = (unsigned char) (offset & 0xFF);
+    *output++ = (unsigned char) (offset >> 8);
+
+    matchLength -= LZ_MIN_MATCH;
+    *token |= (unsigned char) (matchLength < 15 ? matchLength : 15);
+    if (matchLength >= 15)
+        output = lzWriteLength(output, matchLength - 15);
+
+    return output;
+}
+
+//-----------------------------------------------------------------------------
+//! Compresses inputLength bytes from input with a greedy LZ77 compressor 
+//! producing the LZ4 block format.
+//!
+//! @return size of the compressed data or 0 if it doesn't fit into 
+//!         outputCapacity bytes.
+//-----------------------------------------------------------------------------
+size_t lzCompress(const unsigned char* input, size_t inputLength, unsigned char* output, size_t outputCapacity)
+{
+    assert(input);
+    assert(output);
+
+    const unsigned char* outputEnd = output + outputCapacity;
+    unsigned char*       current   = output;
+
+    size_t anchor = 0;
+    if (inputLength > LZ_MATCH_SAFE_DISTANCE)
+    {
+        uint32_t table[1 << LZ_HASH_BITS] = {};
+
+        size_t position     = 1;
+        size_t matchLimit   = inputLength - LZ_LAST_LITERALS;
+        size_t searchLimit  = inputLength - LZ_MATCH_SAFE_DISTANCE;
+        size_t missesCount  = 0;
+        while (position < searchLimit)
+        {
+            uint32_t sequence  = read32(input + position);
+            uint32_t hash      = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+            size_t   reference = table[hash];
+            table[hash] = (uint32_t) position;
+
+            if (position - reference > LZ_MAX_OFFSET || read32(input + reference) != sequence)
+            {
+                // skip faster through data that doesn't compress
+                position += 1 + (missesCount++ >> 6);
+                continue;
+            }
+
+            missesCount = 0;
+
+            size_t matchLength = LZ_MIN_MATCH;
+            while (position + matchLength < matchLimit && 
+                   input[reference + matchLength] == input[position + matchLength])
+                matchLength++;
+
+            current = lzWriteSequence(current, outputEnd, input + anchor, position - anchor, 
+                                      position - reference, matchLength);
+            if (current == NULL)
+                return 0;
+
+            position += matchLength;
+            anchor    = position;
+
+            if (position - 2 < searchLimit)
+                table[(read32(input + position - 2) * 2654435761u) >> (32 - LZ_HASH_BITS)] = (uint32_t) (position - 2);
+        }
+    }
+
+    current = lzWriteSequence(current, outputEnd, input + anchor, inputLength - anchor, 0, 0);
+    if (current == NULL)
+        return 0;
+
+    return (size_t) (current - output);
+}
+
+//-----------------------------------------------------------------------------
+//! Reads length of literals or match written by lzWriteLength.
+//!
+//! @return 0 on success and -1 if input is corrupted.
+//-----------------------------------------------------------------------------
+int lzReadLength(const unsigned char** input, const unsigned char* inputEnd, size_t* length)
+{
+    unsigned char byte = 255;
+    while (byte == 255)
+    {
+        if (*input >= inputEnd)
+            return -1;
+
+        byte     = *(*input)++;
+        *length += byte;
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Decompresses inputLength bytes of data in the LZ4 block format from input 
+//! to output. Corrupted input is detected rather than trusted.
+//!
+//! @return size of the decompressed data or SIZE_MAX if input is corrupted.
+//-----------------------------------------------------------------------------
+size_t lzDecompress(const unsigned char* input, size_t inputLength, unsigned char* output, size_t outputCapacity)
+{
+    assert(input);
+    assert(output);
+
+    const unsigned char* inputEnd  = input + inputLength;
+    unsigned char*       current   = output;
+    unsigned char*       outputEnd = output + outputCapacity;
+
+    while (input < inputEnd)
+    {
+        unsigned char token = *input++;
+
+        size_t literalsLength = token >> 4;
+        if (literalsLength == 15 && lzReadLength(&input, inputEnd, &literalsLength) != 0)
+            return SIZE_MAX;
+
+        if (literalsLength > (size_t) (inputEnd - input) || literalsLength > (size_t) (outputEnd - current))
+            return SIZE_MAX;
+
+        memcpy(current, input, literalsLength);
+        input   += literalsLength;
+        current += literalsLength;
+
+        // the last sequence has no match
+        if (input == inputEnd)
+            break;
+
+        if (inputEnd - input < 2)
+            return SIZE_MAX;
+
+        size_t offset = input[0] | (input[1] << 8);
+        input += 2;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && lzReadLength(&input, inputEnd, &matchLength) != 0)
+            return SIZE_MAX;
+        matchLength += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t) (current - output) || matchLength > (size_t) (outputEnd - current))
+            return SIZE_MAX;
+
+        const unsigned char* match = current - offset;
+        if (offset >= matchLength)
+        {
+            memcpy(current, match, matchLength);
+            current += matchLength;
+        }
+        else
+        {
+            // overlapping match repeats the last offset bytes
+            for (size_t i = 0; i < matchLength; i++)
+                *current++ = *match++;
+        }
+    }
+
+    return (size_t) (current - output);
+}
+
+//-----------------------------------------------------------------------------
+//! Reads and decompresses a block of a compressed file. Thread-safe, as it 
+//! only uses pread on fd.
+//!
+//! @param [in] fd          descriptor of the compressed file
+//! @param [in] fileOffset  offset of the block in the file
+//! @param [in] diskLength  size of the block in the file
+//! @param [in] expectedLength  size of the uncompressed block according to 
+//!                             the index (the header of the block has to 
+//!                             match it)
+//!
+//! @return decompressed block (its data is NULL if an error occurred).
+//-----------------------------------------------------------------------------
+DecodedBlock decodeBlock(int fd, int64_t fileOffset, size_t diskLength, size_t expectedLength)
+{
+    DecodedBlock block = {};
+
+    if (diskLength < COMPRESSED_BLOCK_HEADER || diskLength > COMPRESSED_BLOCK_HEADER + COMPRESSED_BLOCK_SIZE)
+        return block;
+
+    unsigned char* packed = (unsigned char*)malloc(diskLength);
+    if (packed == NULL)
+        return block;
+
+    if (preadAll(fd, fileOffset, diskLength, packed) != (ssize_t) diskLength)
+    {
+        free(packed);
+        return block;
+    }
+
+    uint32_t packedLength = read32(packed);
+    uint32_t rawLength    = read32(packed + sizeof(uint32_t));
+    if (packedLength != diskLength - COMPRESSED_BLOCK_HEADER || rawLength != expectedLength ||
+        rawLength > COMPRESSED_BLOCK_SIZE)
+    {
+        free(packed);
+        return block;
+    }
+
+    block.data = (unsigned char*)malloc(rawLength > 0 ? rawLength : 1);
+    if (block.data == NULL)
+    {
+        free(packed);
+        return block;
+    }
+
+    // incompressible blocks are stored as they are
+    size_t decodedLength = rawLength;
+    if (packedLength == rawLength)
+        memcpy(block.data, packed + COMPRESSED_BLOCK_HEADER, rawLength);
+    else
+        decodedLength = lzDecompress(packed + COMPRESSED_BLOCK_HEADER, packedLength, block.data, rawLength);
+
+    free(packed);
+
+    if (decodedLength != rawLength)
+    {
+        free(block.data);
+        block.data = NULL;
+        return block;
+    }
+
+    block.length = rawLength;
+
+    return block;
+}
+
+//-----------------------------------------------------------------------------
+//! @return size of block number blockNumber of compressed in the file.
+//-----------------------------------------------------------------------------
+size_t blockDiskLength(const CompressedFile* compressed, size_t blockNumber)
+{
+    assert(compressed);
+    assert(blockNumber < compressed->blocksCount);
+
+    int64_t end = blockNumber + 1 < compressed->blocksCount ? 
+                  compressed->index[blockNumber + 1].fileOffset : compressed->indexOffset;
+
+    return (size_t) (end - compressed->index[blockNumber].fileOffset);
+}
+
+//-----------------------------------------------------------------------------
+//! @return size of block number blockNumber of compressed when uncompressed.
+//-----------------------------------------------------------------------------
+size_t blockRawLength(const CompressedFile* compressed, size_t blockNumber)
+{
+    assert(compressed);
+    assert(blockNumber < compressed->blocksCount);
+
+    int64_t end = blockNumber + 1 < compressed->blocksCount ? 
+                  compressed->index[blockNumber + 1].rawOffset : compressed->rawLength;
+
+    return (size_t) (end - compressed->index[blockNumber].rawOffset);
+}
+
+//-----------------------------------------------------------------------------
+//! Main function of the readahead worker of compressed. Decompresses up to
+//! COMPRESSED_READAHEAD blocks following the one being read. Blocks decoded
+//! for a previous epoch (before the reader jumped elsewhere) are dropped.
+//-----------------------------------------------------------------------------
+void runReadahead(CompressedFile* compressed, int fd)
+{
+    assert(compressed);
+
+    std::unique_lock<std::mutex> lock(compressed->readaheadMutex);
+    while (true)
+    {
+        compressed->readaheadChanged.wait(lock, [compressed] 
+        {
+            return compressed->stopWorker ||
+                   (compressed->readaheadNext < compressed->blocksCount &&
+                    compressed->readaheadNext - compressed->readaheadFirst < COMPRESSED_READAHEAD);
+        });
+
+        if (compressed->stopWorker)
+            break;
+
+        size_t   blockNumber = compressed->readaheadNext++;
+        uint64_t epoch       = compressed->readaheadEpoch;
+        lock.unlock();
+
+        DecodedBlock block = decodeBlock(fd, compressed->index[blockNumber].fileOffset, 
+                                         blockDiskLength(compressed, blockNumber),
+                                         blockRawLength(compressed, blockNumber));
+
+        lock.lock();
+        if (epoch == compressed->readaheadEpoch)
+            compressed->ready.push_back(block);
+        else
+            free(block.data);
+
+        compressed->readaheadChanged.notify_all();
+    }
+}
+
+//-----------------------------------------------------------------------------
+//! Stops the readahead worker of compressed and frees the blocks it has 
+//! decompressed.
+//-----------------------------------------------------------------------------
+void stopReadahead(CompressedFile* compressed)
+{
+    assert(compressed);
+
+    if (compressed->workerState == WORKER_RUNNING)
+    {
+        {
+            std::lock_guard<std::mutex> lock(compressed->readaheadMutex);
+            compressed->stopWorker = 1;
+        }
+
+        compressed->readaheadChanged.notify_all();
+        compressed->worker.join();
+        compressed->workerState = WORKER_NOT_STARTED;
+    }
+
+    for (DecodedBlock& block : compressed->ready)
+        free(block.data);
+
+    compressed->ready.clear();
+}
+
+//-----------------------------------------------------------------------------
+//! Returns block number blockNumber of file decompressed. Blocks following it
+//! are decompressed in advance by a worker thread started with the first
+//! call, so sequential reading usually doesn't wait for decompression. If 
+//! the thread can't be started the blocks are decompressed here.
+//!
+//! @return decompressed block (its data is NULL if an error occurred).
+//-----------------------------------------------------------------------------
+DecodedBlock loadBlock(File* file, size_t blockNumber)
+{
+    assert(file);
+
+    CompressedFile* compressed = file->compressed;
+    int             fd         = fileno(file->cfile);
+
+    if (compressed->workerState == WORKER_NOT_STARTED && blockNumber + 1 < compressed->blocksCount)
+    {
+        compressed->readaheadFirst = blockNumber;
+        compressed->readaheadNext  = blockNumber;
+        try
+        {
+            compressed->worker      = std::thread(runReadahead, compressed, fd);
+            compressed->workerState = WORKER_RUNNING;
+        }
+        catch (const std::system_error&)
+        {
+            compressed->workerState = WORKER_UNAVAILABLE;
+        }
+    }
+
+    if (compressed->workerState == WORKER_RUNNING)
+    {
+        std::unique_lock<std::mutex> lock(compressed->readaheadMutex);
+        if (blockNumber == compressed->readaheadFirst && compressed->readaheadNext > blockNumber)
+        {
+            compressed->readaheadChanged.wait(lock, [compressed] { return !compressed->ready.empty(); });
+
+            DecodedBlock block = compressed->ready.front();
+            compressed->ready.pop_front();
+            compressed->readaheadFirst++;
+
+            lock.unlock();
+            compressed->readaheadChanged.notify_all();
+
+            return block;
+        }
+
+        // the reader has jumped, everything decoded in advance is useless
+        for (DecodedBlock& block : compressed->ready)
+            free(block.data);
+
+        compressed->ready.clear();
+        compressed->readaheadEpoch++;
+        compressed->readaheadFirst = blockNumber + 1;
+        compressed->readaheadNext  = blockNumber + 1;
+
+        lock.unlock();
+        compressed->readaheadChanged.notify_all();
+    }
+
+    return decodeBlock(fd, compressed->index[blockNumber].fileOffset, blockDiskLength(compressed, blockNumber),
+                       blockRawLength(compressed, blockNumber));
+}
+
+//-----------------------------------------------------------------------------
+//! Reads up to bytesCount bytes of uncompressed data from file.
+//!
+//! @return number of bytes read (less than bytesCount only at the end of 
+//!         file or if an error occurred, in which case decodeError of the
+//!         compressed data of file is set).
+//-----------------------------------------------------------------------------
+size_t readCompressed(File* file, unsigned char* destination, size_t bytesCount)
+{
+    assert(file);
+    assert(destination);
+
+    CompressedFile* compressed = file->compressed;
+
+    size_t bytesRead = 0;
+    while (bytesRead < bytesCount)
+    {
+        if (compressed->blockPosition >= compressed->blockLength)
+        {
+            if (compressed->nextBlock >= compressed->blocksCount)
+                break;
+
+            free(compressed->block);
+            compressed->block       = NULL;
+            compressed->blockLength = 0;
+
+            DecodedBlock block = loadBlock(file, compressed->nextBlock);
+            if (block.data == NULL)
+            {
+                compressed->decodeError = 1;
+                break;
+            }
+
+            compressed->block         = block.data;
+            compressed->blockLength   = block.length;
+            compressed->blockPosition = 0;
+            compressed->nextBlock++;
+        }
+
+        size_t toCopy = compressed->blockLength - compressed->blockPosition;
+        if (toCopy > bytesCount - bytesRead)
+            toCopy = bytesCount - bytesRead;
+
+        memcpy(destination + bytesRead, compressed->block + compressed->blockPosition, toCopy);
+        compressed->blockPosition += toCopy;
+        bytesRead                 += toCopy;
+    }
+
+    return bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+//! @return number of the block of compressed that contains the byte with 
+//!         uncompressed offset.
+//-----------------------------------------------------------------------------
+size_t findBlock(const CompressedFile* compressed, int64_t offset)
+{
+    assert(compressed);
+
+    size_t left  = 0;
+    size_t right = compressed->blocksCount;
+    while (right - left > 1)
+    {
+        size_t middle = left + (right - left) / 2;
+        if (compressed->index[middle].rawOffset <= offset)
+            left = middle;
+        else
+            right = middle;
+    }
+
+    return left;
+}
+
+//-----------------------------------------------------------------------------
+//! Moves the position of uncompressed data in file to target.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int seekCompressed(File* file, int64_t target)
+{
+    assert(file);
+
+    CompressedFile* compressed = file->compressed;
+
+    free(compressed->block);
+    compressed->block         = NULL;
+    compressed->blockLength   = 0;
+    compressed->blockPosition = 0;
+
+    if (target >= compressed->rawLength)
+    {
+        compressed->nextBlock = compressed->blocksCount;
+        return 0;
+    }
+
+    size_t       blockNumber = findBlock(compressed, target);
+    DecodedBlock block       = loadBlock(file, blockNumber);
+    if (block.data == NULL)
+    {
+        compressed->decodeError = 1;
+        return -1;
+    }
+
+    size_t blockPosition = (size_t) (target - compressed->index[blockNumber].rawOffset);
+    if (target < compressed->index[blockNumber].rawOffset || blockPosition >= block.length)
+    {
+        free(block.data);
+        compressed->decodeError = 1;
+        return -1;
+    }
+
+    compressed->block         = block.data;
+    compressed->blockLength   = block.length;
+    compressed->blockPosition = blockPosition;
+    compressed->nextBlock     = blockNumber + 1;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads length bytes of uncompressed data starting from offset without
+//! changing the current position in file. Only the blocks that contain the
+//! data requested are decompressed, the last of them is kept, so that small
+//! reads close to each other decompress it only once. Thread-safe.
+//!
+//! @return number of bytes read or FILE_END if an error occurred.
+//-----------------------------------------------------------------------------
+size_t readCompressedAt(File* file, int64_t offset, size_t length, unsigned char* destination)
+{
+    assert(file);
+    assert(destination);
+
+    CompressedFile* compressed = file->compressed;
+    int             fd         = fileno(file->cfile);
+
+    size_t bytesRead = 0;
+    while (bytesRead < length && offset < compressed->rawLength)
+    {
+        size_t blockNumber = findBlock(compressed, offset);
+
+        std::unique_lock<std::mutex> lock(compressed->lastAtMutex);
+        if (compressed->lastAtBlock == NULL || compressed->lastAtNumber != blockNumber)
+        {
+            lock.unlock();
+
+            DecodedBlock block = decodeBlock(fd, compressed->index[blockNumber].fileOffset, 
+                                             blockDiskLength(compressed, blockNumber),
+                                             blockRawLength(compressed, blockNumber));
+            if (block.data == NULL)
+            {
+                compressed->decodeError = 1;
+                return FILE_END;
+            }
+
+            lock.lock();
+            free(compressed->lastAtBlock);
+            compressed->lastAtBlock  = block.data;
+            compressed->lastAtNumber = blockNumber;
+            compressed->lastAtLength = block.length;
+        }
+
+        size_t blockOffset = (size_t) (offset - compressed->index[blockNumber].rawOffset);
+        if (offset < compressed->index[blockNumber].rawOffset || blockOffset >= compressed->lastAtLength)
+        {
+            compressed->decodeError = 1;
+            return FILE_END;
+        }
+
+        size_t toCopy = compressed->lastAtLength - blockOffset;
+        if (toCopy > length - bytesRead)
+            toCopy = length - bytesRead;
+
+        memcpy(destination + bytesRead, compressed->lastAtBlock + blockOffset, toCopy);
+
+        bytesRead += toCopy;
+        offset    += (int64_t) toCopy;
+    }
+
+    return bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+//! Compresses the data accumulated for the current block of file and writes
+//! it to the C stream of file.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int flushCompressedBlock(File* file)
+{
+    assert(file);
+
+    CompressedFile* compressed = file->compressed;
+    if (compressed->rawUsed == 0)
+        return 0;
+
+    if (compressed->blocksCount == compressed->indexCapacity)
+    {
+        size_t newCapacity = compressed->indexCapacity == 0 ? 64 : compressed->indexCapacity * 2;
+
+        CompressedBlockInfo* newIndex = (CompressedBlockInfo*)realloc(compressed->index, newCapacity * sizeof(CompressedBlockInfo));
+        if (newIndex == NULL)
+            return -1;
+
+        compressed->index         = newIndex;
+        compressed->indexCapacity = newCapacity;
+    }
+
+    uint32_t rawLength    = (uint32_t) compressed->rawUsed;
+    uint32_t packedLength = (uint32_t) lzCompress(compressed->raw, rawLength, 
+                                                  compressed->packed + COMPRESSED_BLOCK_HEADER, rawLength - 1);
+    if (packedLength == 0)
+    {
+        memcpy(compressed->packed + COMPRESSED_BLOCK_HEADER, compressed->raw, rawLength);
+        packedLength = rawLength;
+    }
+
+    write32(compressed->packed,                    packedLength);
+    write32(compressed->packed + sizeof(uint32_t), rawLength);
+
+    size_t diskLength = COMPRESSED_BLOCK_HEADER + packedLength;
+    if (fwrite(compressed->packed, sizeof(char), diskLength, file->cfile) != diskLength)
+        return -1;
+
+    compressed->index[compressed->blocksCount].fileOffset = compressed->fileOffset;
+    compressed->index[compressed->blocksCount].rawOffset  = compressed->rawLength;
+    compressed->blocksCount++;
+
+    compressed->fileOffset += (int64_t) diskLength;
+    compressed->rawLength  += rawLength;
+    compressed->rawUsed     = 0;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes bytesCount bytes from data to compressed file. The data is 
+//! accumulated and compressed in blocks of COMPRESSED_BLOCK_SIZE bytes.
+//!
+//! @return number of bytes written.
+//-----------------------------------------------------------------------------
+size_t writeCompressed(File* file, const void* data, size_t bytesCount)
+{
+    assert(file);
+    assert(data);
+
+    CompressedFile* compressed = file->compressed;
+
+    size_t written = 0;
+    while (written < bytesCount)
+    {
+        size_t toCopy = COMPRESSED_BLOCK_SIZE - compressed->rawUsed;
+        if (toCopy > bytesCount - written)
+            toCopy = bytesCount - written;
+
+        memcpy(compressed->raw + compressed->rawUsed, (const unsigned char*) data + written, toCopy);
+        compressed->rawUsed += toCopy;
+        written             += toCopy;
+
+        if (compressed->rawUsed == COMPRESSED_BLOCK_SIZE && flushCompressedBlock(file) != 0)
+            return written - toCopy;
+    }
+
+    return written;
+}
+
+//-----------------------------------------------------------------------------
+//! Frees compressed.
+//-----------------------------------------------------------------------------
+void destroyCompressed(CompressedFile* compressed)
+{
+    if (compressed == NULL)
+        return;
+
+    stopReadahead(compressed);
+
+    free(compressed->index);
+    free(compressed->block);
+    free(compressed->lastAtBlock);
+    free(compressed->raw);
+    free(compressed->packed);
+    delete compressed;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads the index of compressed file opened in 'r' mode.
+//!
+//! @return 0 on success and -1 if file is not a valid compressed file.
+//-----------------------------------------------------------------------------
+int readCompressedIndex(File* file)
+{
+    assert(file);
+
+    CompressedFile* compressed = file->compressed;
+    int             fd         = fileno(file->cfile);
+
+    struct stat fileStat = {};
+    if (fstat(fd, &fileStat) != 0 || 
+        fileStat.st_size < (off_t) (COMPRESSED_HEADER_SIZE + COMPRESSED_FOOTER_SIZE))
+        return -1;
+
+    unsigned char header[COMPRESSED_HEADER_SIZE] = {};
+    unsigned char footer[COMPRESSED_FOOTER_SIZE] = {};
+    if (preadAll(fd, 0, COMPRESSED_HEADER_SIZE, header) != (ssize_t) COMPRESSED_HEADER_SIZE ||
+        preadAll(fd, fileStat.st_size - COMPRESSED_FOOTER_SIZE, COMPRESSED_FOOTER_SIZE, footer) != (ssize_t) COMPRESSED_FOOTER_SIZE)
+        return -1;
+
+    if (memcmp(header, COMPRESSED_MAGIC, 4) != 0 || read32(header + 4) != COMPRESSED_VERSION ||
+        memcmp(footer + 24, COMPRESSED_FOOTER_MAGIC, 8) != 0)
+        return -1;
+
+    uint64_t indexOffset = read64(footer);
+    uint64_t blocksCount = read64(footer + 8);
+    uint64_t rawLength   = read64(footer + 16);
+
+    uint64_t indexEnd = (uint64_t) fileStat.st_size - COMPRESSED_FOOTER_SIZE;
+    if (indexOffset < COMPRESSED_HEADER_SIZE || indexOffset > indexEnd ||
+        blocksCount != (indexEnd - indexOffset) / COMPRESSED_INDEX_ENTRY_SIZE ||
+        (indexEnd - indexOffset) % COMPRESSED_INDEX_ENTRY_SIZE != 0 ||
+        (blocksCount == 0) != (rawLength == 0) ||
+        rawLength > blocksCount * COMPRESSED_BLOCK_SIZE)
+        return -1;
+
+    size_t         indexLength = blocksCount * COMPRESSED_INDEX_ENTRY_SIZE;
+    unsigned char* encoded     = (unsigned char*)malloc(indexLength > 0 ? indexLength : 1);
+    compressed->index = (CompressedBlockInfo*)malloc(blocksCount > 0 ? blocksCount * sizeof(CompressedBlockInfo) : 1);
+    if (encoded == NULL || compressed->index == NULL ||
+        preadAll(fd, (int64_t) indexOffset, indexLength, encoded) != (ssize_t) indexLength)
+    {
+        free(encoded);
+        return -1;
+    }
+
+    for (size_t i = 0; i < blocksCount; i++)
+    {
+        compressed->index[i].fileOffset = (int64_t) read64(encoded + i * COMPRESSED_INDEX_ENTRY_SIZE);
+        compressed->index[i].rawOffset  = (int64_t) read64(encoded + i * COMPRESSED_INDEX_ENTRY_SIZE + 8);
+    }
+
+    free(encoded);
+
+    compressed->blocksCount   = blocksCount;
+    compressed->indexCapacity = blocksCount;
+    compressed->indexOffset   = (int64_t) indexOffset;
+    compressed->rawLength     = (int64_t) rawLength;
+
+    // blocks have to follow each other and each of them has to hold from 1 to
+    // COMPRESSED_BLOCK_SIZE bytes of data, so that offsets found by the index
+    // always lie inside the decompressed blocks
+    if (blocksCount > 0 && (compressed->index[0].fileOffset != (int64_t) COMPRESSED_HEADER_SIZE ||
+                            compressed->index[0].rawOffset  != 0))
+        return -1;
+
+    for (size_t i = 0; i < blocksCount; i++)
+    {
+        uint64_t nextFileOffset = i + 1 < blocksCount ? (uint64_t) compressed->index[i + 1].fileOffset : indexOffset;
+        uint64_t nextRawOffset  = i + 1 < blocksCount ? (uint64_t) compressed->index[i + 1].rawOffset  : rawLength;
+        uint64_t fileOffset     = (uint64_t) compressed->index[i].fileOffset;
+        uint64_t rawOffset      = (uint64_t) compressed->index[i].rawOffset;
+
+        if (nextFileOffset <= fileOffset || nextFileOffset > indexOffset ||
+            nextFileOffset - fileOffset > COMPRESSED_BLOCK_HEADER + COMPRESSED_BLOCK_SIZE ||
+            nextRawOffset  <= rawOffset  || nextRawOffset > rawLength ||
+            nextRawOffset  - rawOffset  > COMPRESSED_BLOCK_SIZE)
+            return -1;
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Prepares file just opened to be read or written as a compressed file.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int openCompressed(File* file)
+{
+    assert(file);
+
+    file->compressed = new (std::nothrow) CompressedFile;
+    if (file->compressed == NULL)
+        return -1;
+
+    CompressedFile* compressed = file->compressed;
+
+    if (file->mode == 'r')
+    {
+        if (readCompressedIndex(file) != 0)
+        {
+            destroyCompressed(compressed);
+            file->compressed = NULL;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    compressed->raw    = (unsigned char*)malloc(COMPRESSED_BLOCK_SIZE);
+    compressed->packed = (unsigned char*)malloc(COMPRESSED_BLOCK_HEADER + COMPRESSED_BLOCK_SIZE);
+
+    unsigned char header[COMPRESSED_HEADER_SIZE] = {};
+    memcpy(header, COMPRESSED_MAGIC, 4);
+    write32(header + 4, COMPRESSED_VERSION);
+    write32(header + 8, (uint32_t) COMPRESSED_BLOCK_SIZE);
+
+    if (compressed->raw == NULL || compressed->packed == NULL ||
+        fwrite(header, sizeof(char), COMPRESSED_HEADER_SIZE, file->cfile) != COMPRESSED_HEADER_SIZE)
+    {
+        destroyCompressed(compressed);
+        file->compressed = NULL;
+        return -1;
+    }
+
+    compressed->fileOffset = COMPRESSED_HEADER_SIZE;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Finishes compressed file (writes the last block and the index in 'w' 
+//! mode) and frees its compression data.
+//!
+//! @return 0 on success and -1 if an error occurred (including a block that
+//!         failed to decompress while file was read).
+//-----------------------------------------------------------------------------
+int closeCompressed(File* file)
+{
+    assert(file);
+
+    CompressedFile* compressed = file->compressed;
+
+    int result = compressed->decodeError ? -1 : 0;
+    if (file->mode != 'r')
+    {
+        if (flushCompressedBlock(file) != 0)
+            result = -1;
+
+        // the index is encoded in pieces that fit into the buffer of a block
+        unsigned char* encoded      = compressed->packed;
+        size_t         entriesCount = COMPRESSED_BLOCK_SIZE / COMPRESSED_INDEX_ENTRY_SIZE;
+        for (size_t first = 0; first < compressed->blocksCount; first += entriesCount)
+        {
+            size_t count = compressed->blocksCount - first < entriesCount ? 
+                           compressed->blocksCount - first : entriesCount;
+
+            for (size_t i = 0; i < count; i++)
+            {
+                write64(encoded + i * COMPRESSED_INDEX_ENTRY_SIZE,     (uint64_t) compressed->index[first + i].fileOffset);
+                write64(encoded + i * COMPRESSED_INDEX_ENTRY_SIZE + 8, (uint64_t) compressed->index[first + i].rawOffset);
+            }
+
+            size_t encodedLength = count * COMPRESSED_INDEX_ENTRY_SIZE;
+            if (fwrite(encoded, sizeof(char), encodedLength, file->cfile) != encodedLength)
+                result = -1;
+        }
+
+        unsigned char footer[COMPRESSED_FOOTER_SIZE] = {};
+        write64(footer,      (uint64_t) compressed->fileOffset);
+        write64(footer + 8,  compressed->blocksCount);
+        write64(footer + 16, (uint64_t) compressed->rawLength);
+        memcpy(footer + 24, COMPRESSED_FOOTER_MAGIC, 8);
+
+        if (fwrite(footer, sizeof(char), COMPRESSED_FOOTER_SIZE, file->cfile) != COMPRESSED_FOOTER_SIZE)
+            result = -1;
+    }
+
+    destroyCompressed(compressed);
+    file->compressed = NULL;
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in] file  pointer to the compressed file opened in 'r' mode
+//!
+//! @return number of independently compressed blocks in file or 0 if file 
+//!         is not compressed.
+//-----------------------------------------------------------------------------
+size_t getFileBlocksCount(File* file)
+{
+    if (file == NULL || file->compressed == NULL || file->mode != 'r')
+        return 0;
+
+    return file->compressed->blocksCount;
+}
+
+//-----------------------------------------------------------------------------
+//! Returns the offset of the beginning of block number blockNumber in the 
+//! uncompressed data of file. Compressed files can be scanned in parallel by
+//! opening the file several times and seeking to different blocks, as no
+//! block depends on the previous ones.
+//!
+//! @param [in] file         pointer to the compressed file opened in 'r' mode
+//! @param [in] blockNumber  
+//!
+//! @return offset of the block or -1 if there's no such block.
+//-----------------------------------------------------------------------------
+int64_t getFileBlockOffset(File* file, size_t blockNumber)
+{
+    if (file == NULL || file->compressed == NULL || file->mode != 'r' ||
+        blockNumber >= file->compressed->blocksCount)
+        return -1;
+
+    return file->compressed->index[blockNumber].rawOffset;
+}
+
+//-----------------------------------------------------------------------------
+//! Passes length characters of formatted output from data to sink.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int sinkWrite(FormatSink* sink, const char* data, size_t length)
+{
+    assert(sink);
+
+    sink->length += length;
+    if (sink->write == NULL || length == 0)
+        return 0;
+
+    return sink->write(sink, data, length);
+}
+
+//-----------------------------------------------------------------------------
+//! Takes the next argument of type from the va_list of args.
+//!
+//! @return 0 on success and -1 if a %s argument is NULL.
+//-----------------------------------------------------------------------------
+int nextVaArg(FormatArgs* args, char type, char* scratch, StringView* text)
+{
+    switch (type)
+    {
+        case 'c':
+        scratch[0]   = (char) va_arg(args->valist, int);
+        text->str    = scratch;
+        text->length = 1;
+        return 0;
+
+        case 'd':
+        text->str    = scratch;
+        text->length = intToChars(va_arg(args->valist, int), scratch);
+        return 0;
+
+        case 's':
+        {
+            const char* value = va_arg(args->valist, const char*);
+            if (value == NULL)
+                return -1;
+
+            text->str    = value;
+            text->length = strLength(value);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+//! Formats str to sink. All %c, %d and %s from str are changed to char, int 
+//! or char* string equivalents of the arguments taken from args. Text between
+//! the indicators is passed to sink in whole runs rather than char by char.
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int formatToSink(FormatSink* sink, const char* str, FormatArgs* args)
+{
+    assert(sink);
+    assert(str);
+    assert(args);
+
+    int successfullyInterpreted = 0;
+    while (*str != STRING_TERMINATION)
+    {
+        const char* literal = str;
+        while (*str != STRING_TERMINATION && *str != '%')
+            str++;
+
+        if (sinkWrite(sink, literal, (size_t) (str - literal)) != 0)
+            return -1;
+
+        if (*str == STRING_TERMINATION)
+            break;
+
+        str++;
+
+        // a lone '%' at the end of str is written as it is
+        if (*str == STRING_TERMINATION)
+            return sinkWrite(sink, "%", 1) == 0 ? successfullyInterpreted : -1;
+
+        int result = 0;
+        switch (*str)
+        {
+            case 'c':
+            case 'd':
+            case 's':
+            {
+                char       scratch[11] = {};
+                StringView text        = {};
+                result = args->next(args, *str, scratch, &text);
+                if (result == 0)
+                    result = sinkWrite(sink, text.str, text.length);
+
+                successfullyInterpreted++;
+                break;
+            }
+
+            default:
+            result = sinkWrite(sink, str - 1, 2);
+            break;
+        }
+
+        if (result != 0)
+            return -1;
+
+        str++;
+    }
+
+    return successfullyInterpreted;
+}
+
+//-----------------------------------------------------------------------------
+//! Formats str to sink taking the arguments from valist.
+//-----------------------------------------------------------------------------
+int formatToSink(FormatSink* sink, const char* str, va_list valist)
+{
+    FormatArgs args = {};
+    args.next = nextVaArg;
+    va_copy(args.valist, valist);
+
+    int result = formatToSink(sink, str, &args);
+    va_end(args.valist);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes data of a format sink to its file.
+//-----------------------------------------------------------------------------
+int fileSinkWrite(FormatSink* sink, const char* data, size_t length)
+{
+    return writeBytes((File*) sink->target, data, length) == length ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends data of a format sink to its StringBuilder.
+//-----------------------------------------------------------------------------
+int builderSinkWrite(FormatSink* sink, const char* data, size_t length)
+{
+    return appendString((StringBuilder*) sink->target, data, length);
+}
+
+//-----------------------------------------------------------------------------
+//! Copies as much data of a format sink as fits into its buffer (leaving 
+//! space for the string termination symbol). The rest is only counted.
+//-----------------------------------------------------------------------------
+int bufferSinkWrite(FormatSink* sink, const char* data, size_t length)
+{
+    if (sink->used + 1 >= sink->capacity)
+        return 0;
+
+    size_t toCopy = sink->capacity - 1 - sink->used;
+    if (toCopy > length)
+        toCopy = length;
+
+    memcpy(sink->buffer + sink->used, data, toCopy);
+    sink->used += toCopy;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Passes the data accumulated in the buffer of a callback sink to its 
+//! callback.
+//!
+//! @return 0 on success and -1 if the callback reported an error.
+//-----------------------------------------------------------------------------
+int flushCallbackSink(FormatSink* sink)
+{
+    if (sink->used == 0)
+        return 0;
+
+    size_t used = sink->used;
+    sink->used = 0;
+
+    return sink->callback(sink->buffer, used, sink->target) == 0 ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+//! Accumulates data of a callback sink in its buffer, so that the callback
+//! receives output in chunks rather than in small pieces.
+//-----------------------------------------------------------------------------
+int callbackSinkWrite(FormatSink* sink, const char* data, size_t length)
+{
+    if (length > sink->capacity - sink->used && flushCallbackSink(sink) != 0)
+        return -1;
+
+    if (length >= sink->capacity)
+        return sink->callback(data, length, sink->target) == 0 ? 0 : -1;
+
+    memcpy(sink->buffer + sink->used, data, length);
+    sink->used += length;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes formatted string to file. All %c, %d and %s from str are changed to
+//! char, int or char* string equivalents of args from valist respectively. 
+//!
+//! @param [in] file    pointer to the file to which string is to be written
+//! @param [in] str     pointer to a string containing format in which 
+//!                     specifying how to interpret the arguments from valist
+//! @param [in] valist  
+//!
+//! @note The order of arguments from valist has to be the same as the order of
+//!       %c, %d or %s indicators in str.
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int writeFormatted(File* file, const char* str, va_list valist)
+{
+    if (file        == NULL                      ||
+        file->cfile == NULL                      ||
+        (file->mode != 'w' && file->mode != 'a') ||
+        str         == NULL)
+        return -1;
+
+    FormatSink sink = {};
+    sink.write  = fileSinkWrite;
+    sink.target = file;
+
+    return formatToSink(&sink, str, valist);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes formatted string to file. All %c, %d and %s from str are changed to
+//! char, int or char* string equivalents of args from ... respectively. 
+//!
+//! @param [in] file  pointer to the file to which string is to be written
+//! @param [in] str   pointer to a string containing format in which specifying
+//!                   how to interpret the arguments from ... 
+//! @param [in] ...   arguments
+//!
+//! @note The order of arguments from ... has to be the same as the order of
+//!       %c, %d or %s indicators in str.
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int writeFormatted(File* file, const char* str, ...)
+{
+    va_list valist;
+    va_start(valist, str);
+
+    int result = writeFormatted(file, str, valist);
+
+    va_end(valist);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes formatted string to buffer (in the same way as writeFormatted) and 
+//! adds the string termination symbol after it. If the string doesn't fit, 
+//! buffer contains its first (bufferSize - 1) characters.
+//!
+//! @param [out] buffer      
+//! @param [in]  bufferSize  size of buffer (typically sizeof(buffer))
+//! @param [out] length      length of the whole formatted string (optional). 
+//!                          The string has been truncated if it's not less 
+//!                          than bufferSize.
+//! @param [in]  format      
+//! @param [in]  ...         arguments
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int formatToBuffer(char* buffer, size_t bufferSize, size_t* length, const char* format, ...)
+{
+    if ((buffer == NULL && bufferSize != 0) || format == NULL)
+        return -1;
+
+    FormatSink sink = {};
+    sink.write    = bufferSinkWrite;
+    sink.buffer   = buffer;
+    sink.capacity = bufferSize;
+
+    va_list valist;
+    va_start(valist, format);
+
+    int result = formatToSink(&sink, format, valist);
+
+    va_end(valist);
+
+    if (bufferSize > 0)
+        buffer[sink.used] = STRING_TERMINATION;
+
+    if (length != NULL)
+        *length = sink.length;
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Formats string (in the same way as writeFormatted) and passes it to 
+//! callback in chunks. callback receives the chunk, its length and context 
+//! and returns 0 on success (anything else stops formatting).
+//!
+//! @param [in] callback  
+//! @param [in] context   passed to callback as it is
+//! @param [in] format    
+//! @param [in] ...       arguments
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int formatToCallback(FormatCallback callback, void* context, const char* format, ...)
+{
+    if (callback == NULL || format == NULL)
+        return -1;
+
+    char chunk[FORMAT_CHUNK_SIZE];
+
+    FormatSink sink = {};
+    sink.write    = callbackSinkWrite;
+    sink.target   = context;
+    sink.callback = callback;
+    sink.buffer   = chunk;
+    sink.capacity = sizeof(chunk);
+
+    va_list valist;
+    va_start(valist, format);
+
+    int result = formatToSink(&sink, format, valist);
+
+    va_end(valist);
+
+    if (flushCallbackSink(&sink) != 0)
+        return -1;
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Calculates the length of the string that writeFormatted would write 
+//! (not including the string termination symbol) without writing it, so 
+//! that memory for it can be allocated at once.
+//!
+//! @param [in] format    
+//! @param [in] ...       arguments
+//!
+//! @return length of formatted string. On error returns 0.
+//-----------------------------------------------------------------------------
+size_t formattedSize(const char* format, ...)
+{
+    if (format == NULL)
+        return 0;
+
+    FormatSink sink = {};
+
+    va_list valist;
+    va_start(valist, format);
+
+    int result = formatToSink(&sink, format, valist);
+
+    va_end(valist);
+
+    return result == -1 ? 0 : sink.length;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads the next char from stdin.
+//!
+//! @return next char or FILE_END if and error occurred.
+//-----------------------------------------------------------------------------
+int consoleNextChar()
+{
+    int ch = getchar();
+    return ch == EOF ? FILE_END : ch;
+}
+
+//-----------------------------------------------------------------------------
+//! Reads the next (maxLength - 1) characters from stdin to line. Adds '\0' at
+//! the end of line.
+//!
+//! @param [in] line       pointer to char* to which characters are to be read
+//! @param [in] maxLength  max number of characters to read 
+//!                        (typically sizeof (line))
+//!
+//! @return line or NULL on failure.
+//-----------------------------------------------------------------------------
+char* consoleNextLine(char* line, size_t maxLength)
+{
+    if (line == NULL)
+        return NULL;
+
+    if (scanf("%s", line) != 1)
+        return NULL;
+
+    return line;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes ch to stdout. ch is converted to unsigned int.
+//!
+//! @param [in] ch  character to be written to stdout
+//!
+//! @return ch or FILE_END on failure.
+//-----------------------------------------------------------------------------
+int consoleWriteChar(char ch)
+{
+    File file;
+    file.cfile = stdout;
+    file.mode  = 'w';
+
+    return writeChar(&file, ch);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes str to stdout.
+//!
+//! @param [in] str  characters to be written to stdout
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int consoleWriteString(const char* str)
+{
+    File file;
+    file.cfile = stdout;
+    file.mode  = 'w';
+
+    return writeString(&file, str);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes line to stdout and adds '\n' after that.
+//!
+//! @param [in] line  characters to be written to stdout
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int consoleWriteLine(const char* line)
+{
+    File file;
+    file.cfile = stdout;
+    file.mode  = 'w';
+
+    return writeLine(&file, line);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes formatted string to stdout. All %c, %d and %s from str are changed to
+//! char, int or char* string equivalents of args from ... respectively. 
+//!
+//! @param [in] str   pointer to a string containing format in which specifying
+//!                   how to interpret the arguments from ... 
+//! @param [in] ...   arguments
+//!
+//! @note The order of arguments from ... has to be the same as the order of
+//!       %c, %d or %s indicators in str.
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int consoleWriteFormatted(const char* str, ...)
+{
+    File file;
+    file.cfile = stdout;
+    file.mode  = 'w';
+    
+    va_list valist;
+    va_start(valist, str);
+
+    int result = writeFormatted(&file, str, valist);
+
+    va_end(valist);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Calls consoleNextChar() until '\n' ("clears buffer of garbage")
+//-----------------------------------------------------------------------------
+void consoleMoveToNextLine()
+{
+    while (consoleNextChar() != '\n') ;
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in]  value
+//!
+//! @return the number of digits in value (not counting the sign).
+//-----------------------------------------------------------------------------
+size_t numberOfDigits (int value)
+{
+    size_t digits = 0;
+    int    temp   = value;
+    while (temp / 10 != 0)
+    {
+        temp /= 10;
+        digits++;
+    }
+
+    return digits + 1;
+}
+
+//-----------------------------------------------------------------------------
+//! Converts int to string. 
+//!
+//! @param [in]  value   value to be converted
+//! @param [out] str     string to which to write result
+//! @param [in]  digits  number of digits of value (not counting the sign)
+//!
+//! @return str or NULL on failure.
+//-----------------------------------------------------------------------------
+char* intToStr (int value, char* str, size_t digits)
+{
+    if (str == NULL)
+        return NULL;
+
+    int i = 0;
+    if (value < 0)
+    {
+        str[0] = '-';
+        i = 1;
+        value = -value;
+    }
+
+    int currentDigit = 0;
+    for (int tensPower = lround(pow(10, digits - 1)); 
+         tensPower >= 1; 
+         tensPower /= 10, i++)
+    {
+        currentDigit = (value / tensPower) % 10;
+
+        str[i] = '0' + currentDigit;
+    }
+
+    str[i] = STRING_TERMINATION;
+
+    return str;
+}
+
+//-----------------------------------------------------------------------------
+//! Converts int to string. 
+//!
+//! @param [in]  value  value to be converted
+//! @param [out] str    string to which to write result
+//!
+//! @return str or NULL on failure.
+//-----------------------------------------------------------------------------
+char* intToStr (int value, char* str)
+{
+    return intToStr(value, str, numberOfDigits(value));
+}
+
+//-----------------------------------------------------------------------------
+//! Converts the first length characters of str to int. Unlike most ioLib 
+//! string functions doesn't need str to be terminated, so it can be used on
+//! views into file buffers.
+//!
+//! @param [in]  str     string to be converted (optional sign and digits)
+//! @param [in]  length  number of characters to convert
+//! @param [out] value   result
+//!
+//! @return 0 on success and -1 if str is not a valid int or it overflows.
+//-----------------------------------------------------------------------------
+int strToInt (const char* str, size_t length, int* value)
+{
+    if (str == NULL || value == NULL || length == 0)
+        return -1;
+
+    size_t i        = 0;
+    int    negative = 0;
+    if (str[0] == '-' || str[0] == '+')
+    {
+        negative = str[0] == '-';
+        i = 1;
+
+        if (length == 1)
+            return -1;
+    }
+
+    // accumulate as a negative number so that INT_MIN is representable
+    long long result = 0;
+    for (; i < length; i++)
+    {
+        if (str[i] < '0' || str[i] > '9')
+            return -1;
+
+        result = result * 10 - (str[i] - '0');
+        if (result < -2147483648LL)
+            return -1;
+    }
+
+    if (!negative)
+    {
+        if (result < -2147483647LL)
+            return -1;
+
+        result = -result;
+    }
+
+    *value = (int) result;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Calculates the length of str (not including the string termination symbol). 
+//!
+//! @param [in]  str  
+//!
+//! @return number of characters in str or 0 on failure.
+//-----------------------------------------------------------------------------
+size_t strLength (const char* str)
+{
+    if (str == NULL)
+        return 0;
+
+    size_t length = 0;
+    for (char* currentSymbol = (char*) str; *currentSymbol != STRING_TERMINATION; currentSymbol++)
+        length++;
+
+    return length;
+}
+
+//-----------------------------------------------------------------------------
+//! Compares two strings.
+//! @param [in]  str1
+//! @param [in]  str2
+//! @return positive integer if str1 > str2, negative if str1 < str2
+//!         and 0 if str1 = str2
+//-----------------------------------------------------------------------------
+int strCompare (const unsigned char* str1, const unsigned char* str2)
+{
+    assert(str1);
+    assert(str2);
+
+    unsigned char* ptr1 = (unsigned char*) str1;
+    unsigned char* ptr2 = (unsigned char*) str2;
+    while (*ptr1 == *ptr2)
+    {
+        if (*ptr1 == STRING_TERMINATION) 
+            return 0;
+
+        ptr1++;
+        ptr2++;
+    }
+
+    return *ptr1 - *ptr2;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends the content of source to destination. Undefined behavior if there's
+//! not enough space in destination. 
+//!
+//! @param [out]  destination
+//! @param [in]   source
+//!
+//! @return destination
+//-----------------------------------------------------------------------------
+char* strConcatenate (char* destination, const char* source)
+{
+    if (destination == NULL)
+        return NULL;
+    if (source == NULL)
+        return destination;
+
+    char* ptrDestination = destination;
+    while (*ptrDestination != STRING_TERMINATION) ptrDestination++;
+
+    for (char* ptrSource = (char*) source; *ptrSource != STRING_TERMINATION; ptrSource++, ptrDestination++)
+        *ptrDestination = *ptrSource;
+
+    *ptrDestination = STRING_TERMINATION;
+    
+    return ptrDestination;
+}
+
+//-----------------------------------------------------------------------------
+//! Finds the firt occurrence of substr in str and returns the pointer to it. 
+//!
+//! @param [in]  str
+//! @param [in]  substr  
+//!
+//! @return pointer to the first occurrence of substr in str or NULL on 
+//!         failure.
+//-----------------------------------------------------------------------------
+char* strFind (const char* str, const char* substr)
+{
+    if (str == NULL || substr == NULL)
+        return NULL;
+
+    return strFind(toStringView(str), toStringView(substr));
+}
+
+//-----------------------------------------------------------------------------
+//! Finds the firt occurrence of substr in str and returns the pointer to it. 
+//! Checks only first maxSymbolsToCheck symbols of str.
+//!
+//! @param [in]  str
+//! @param [in]  substr 
+//! @param [in]  maxSymbolsToCheck
+//!
+//! @return pointer to the first occurrence of substr in str or NULL on 
+//!         failure.
+//-----------------------------------------------------------------------------
+char* strFind (const char* str, const char* substr, size_t maxSymbolsToCheck)
+{
+    if (str == NULL || substr == NULL)
+        return NULL;
+
+    size_t length = 0;
+    while (length < maxSymbolsToCheck && str[length] != STRING_TERMINATION)
+        length++;
+
+    return strFind(toStringView(str, length), toStringView(substr));
+}
+
+//-----------------------------------------------------------------------------
+//! Counts how many instances of symbol are in str.
+//!
+//! @param [in]  str
+//! @param [in]  symbol 
+//!
+//! @return number of occurrences of symbol in string. On error returns 0.
+//-----------------------------------------------------------------------------
+size_t strNumOfOccurrences(const char* str, char symbol)
+{
+    if (str == NULL)
+        return 0;
+    
+    size_t numOfOccurrences = 0;
+    for(; *str != STRING_TERMINATION; str++)
+        if (*str == symbol)
+            numOfOccurrences++;
+
+    return numOfOccurrences;
+}
+
+//-----------------------------------------------------------------------------
+//! Counts how many instances of symbol are in str, but checks only
+//! maxSymbolsToCheck symbols.
+//!
+//! @param [in]  str
+//! @param [in]  symbol 
+//! @param [in]  maxSymbolsToCheck 
+//!
+//! @return number of occurrences of symbol in first maxSymbolsToCheck symbols
+//!         of string. On error returns 0.
+//-----------------------------------------------------------------------------
+size_t strNumOfOccurrences(const char* str, char symbol, size_t maxSymbolsToCheck)
+{
+    if (str == NULL)
+        return 0;
+
+    size_t numOfOccurrences = 0;
+    size_t symbolsChecked   = 0;
+    for(; *str != STRING_TERMINATION && symbolsChecked < maxSymbolsToCheck; str++, symbolsChecked++)
+        if (*str == symbol)
+            numOfOccurrences++;
+
+    return numOfOccurrences;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends the content of source to destination, but writes no more than 
+//! maxLength characters to destination (including the string termination 
+//! symbol). Unlike strConcatenate(destination, source) never writes past 
+//! destination.
+//!
+//! @param [out]  destination
+//! @param [in]   source
+//! @param [in]   maxLength    size of destination (typically sizeof(destination))
+//!
+//! @return pointer to the string termination symbol of destination or NULL if
+//!         source didn't fit (destination then contains as much of it as 
+//!         fits).
+//-----------------------------------------------------------------------------
+char* strConcatenate (char* destination, const char* source, size_t maxLength)
+{
+    if (destination == NULL || maxLength == 0)
+        return NULL;
+
+    char* ptrDestination = destination;
+    char* end            = destination + maxLength - 1;
+    while (ptrDestination < end && *ptrDestination != STRING_TERMINATION) ptrDestination++;
+
+    if (source != NULL)
+    {
+        for (; ptrDestination < end && *source != STRING_TERMINATION; source++, ptrDestination++)
+            *ptrDestination = *source;
+    }
+
+    *ptrDestination = STRING_TERMINATION;
+
+    if (source != NULL && *source != STRING_TERMINATION)
+        return NULL;
+
+    return ptrDestination;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes decimal representation of value to str without the string 
+//! termination symbol. str has to have space for at least 11 characters.
+//!
+//! @return number of characters written.
+//-----------------------------------------------------------------------------
+size_t intToChars(int value, char* str)
+{
+    assert(str);
+
+    char     digits[10] = {};
+    size_t   digitsCount = 0;
+    unsigned absolute    = value < 0 ? 0u - (unsigned) value : (unsigned) value;
+    do
+    {
+        digits[digitsCount++] = (char) ('0' + absolute % 10);
+        absolute /= 10;
+    } while (absolute != 0);
+
+    size_t length = 0;
+    if (value < 0)
+        str[length++] = '-';
+
+    while (digitsCount > 0)
+        str[length++] = digits[--digitsCount];
+
+    return length;
+}
+
+//-----------------------------------------------------------------------------
+//! Initializes builder as an empty string. Short strings are stored in the
+//! builder itself, so no memory is allocated until the string outgrows
+//! STRING_BUILDER_INLINE_SIZE.
+//!
+//! @param [out] builder
+//!
+//! @note builder mustn't be copied by value after it's been initialized.
+//-----------------------------------------------------------------------------
+void initStringBuilder(StringBuilder* builder)
+{
+    if (builder == NULL)
+        return;
+
+    builder->str             = builder->inlineBuffer;
+    builder->length          = 0;
+    builder->capacity        = STRING_BUILDER_INLINE_SIZE;
+    builder->inlineBuffer[0] = STRING_TERMINATION;
+}
+
+//-----------------------------------------------------------------------------
+//! Frees memory allocated by builder. builder is left empty and can be used
+//! again.
+//!
+//! @param [in] builder
+//-----------------------------------------------------------------------------
+void destroyStringBuilder(StringBuilder* builder)
+{
+    if (builder == NULL)
+        return;
+
+    if (builder->str != builder->inlineBuffer)
+        free(builder->str);
+
+    initStringBuilder(builder);
+}
+
+//-----------------------------------------------------------------------------
+//! Makes builder empty without freeing its memory, so that it can be reused 
+//! for the next string.
+//!
+//! @param [in] builder
+//-----------------------------------------------------------------------------
+void clearStringBuilder(StringBuilder* builder)
+{
+    if (builder == NULL || builder->str == NULL)
+        return;
+
+    builder->length = 0;
+    builder->str[0] = STRING_TERMINATION;
+}
+
+//-----------------------------------------------------------------------------
+//! Makes sure there's space in builder for additionalLength more characters
+//! and the string termination symbol. Capacity grows geometrically, so 
+//! appending n characters one by one takes O(n) time.
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int reserveStringBuilder(StringBuilder* builder, size_t additionalLength)
+{
+    assert(builder);
+
+    if (additionalLength >= SIZE_MAX - builder->length)
+        return -1;
+
+    size_t required = builder->length + additionalLength + 1;
+    if (required <= builder->capacity)
+        return 0;
+
+    size_t newCapacity = builder->capacity * 2;
+    if (newCapacity < required)
+        newCapacity = required;
+
+    char* newStr = NULL;
+    if (builder->str == builder->inlineBuffer)
+    {
+        newStr = (char*)malloc(newCapacity);
+        if (newStr != NULL)
+            memcpy(newStr, builder->inlineBuffer, builder->length + 1);
+    }
+    else
+    {
+        newStr = (char*)realloc(builder->str, newCapacity);
+    }
+
+    if (newStr == NULL)
+        return -1;
+
+    builder->str      = newStr;
+    builder->capacity = newCapacity;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends length characters from str to builder. str may contain the string
+//! termination symbol and may point into builder itself.
+//!
+//! @param [in] builder
+//! @param [in] str
+//! @param [in] length
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int appendString(StringBuilder* builder, const char* str, size_t length)
+{
+    if (builder == NULL || builder->str == NULL || (str == NULL && length != 0))
+        return -1;
+
+    // str may be moved by reserveStringBuilder if it's a part of builder
+    size_t selfOffset = SIZE_MAX;
+    if (str >= builder->str && str < builder->str + builder->capacity)
+        selfOffset = (size_t) (str - builder->str);
+
+    if (reserveStringBuilder(builder, length) != 0)
+        return -1;
+
+    if (selfOffset != SIZE_MAX)
+        str = builder->str + selfOffset;
+
+    memmove(builder->str + builder->length, str, length);
+    builder->length += length;
+    builder->str[builder->length] = STRING_TERMINATION;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends str to builder.
+//!
+//! @param [in] builder
+//! @param [in] str
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int appendString(StringBuilder* builder, const char* str)
+{
+    if (str == NULL)
+        return -1;
+
+    return appendString(builder, str, strLength(str));
+}
+
+//-----------------------------------------------------------------------------
+//! Appends ch to builder.
+//!
+//! @param [in] builder
+//! @param [in] ch
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int appendChar(StringBuilder* builder, char ch)
+{
+    if (builder == NULL || builder->str == NULL || reserveStringBuilder(builder, 1) != 0)
+        return -1;
+
+    builder->str[builder->length++] = ch;
+    builder->str[builder->length]   = STRING_TERMINATION;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends decimal representation of value to builder.
+//!
+//! @param [in] builder
+//! @param [in] value
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int appendInt(StringBuilder* builder, int value)
+{
+    char   digits[11] = {};
+    size_t length     = intToChars(value, digits);
+
+    return appendString(builder, digits, length);
+}
+
+//-----------------------------------------------------------------------------
+//! Appends formatted string to builder. All %c, %d and %s from format are 
+//! changed to char, int or char* string equivalents of args from valist 
+//! respectively (the same way as in writeFormatted).
+//!
+//! @param [in] builder
+//! @param [in] format   
+//! @param [in] valist  
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int appendFormatted(StringBuilder* builder, const char* format, va_list valist)
+{
+    if (builder == NULL || builder->str == NULL || format == NULL)
+        return -1;
+
+    FormatSink sink = {};
+    sink.write  = builderSinkWrite;
+    sink.target = builder;
+
+    return formatToSink(&sink, format, valist);
+}
+
+//-----------------------------------------------------------------------------
+//! Appends formatted string to builder. All %c, %d and %s from format are 
+//! changed to char, int or char* string equivalents of args from ... 
+//! respectively (the same way as in writeFormatted).
+//!
+//! @param [in] builder
+//! @param [in] format   
+//! @param [in] ...  
+//!
+//! @return number of arguments successfully interpreted or -1 if an
+//!         error occurred.
+//-----------------------------------------------------------------------------
+int appendFormatted(StringBuilder* builder, const char* format, ...)
+{
+    va_list valist;
+    va_start(valist, format);
+
+    int result = appendFormatted(builder, format, valist);
+
+    va_end(valist);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes the string built by builder to file directly from the builder's 
+//! memory. Unlike writeString(file, builder->str) doesn't need to calculate
+//! its length and writes characters equal to the string termination symbol
+//! as well.
+//!
+//! @param [in] file     pointer to the file to which string is to be written
+//! @param [in] builder  
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int writeString(File* file, const StringBuilder* builder)
+{
+    if (builder == NULL)
+        return FILE_END;
+
+    return writeString(file, toStringView(builder));
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in] str  
+//!
+//! @return view of str (its length is calculated once here).
+//-----------------------------------------------------------------------------
+StringView toStringView(const char* str)
+{
+    StringView view = {str, strLength(str)};
+
+    return view;
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in] str     
+//! @param [in] length  number of characters in str
+//!
+//! @return view of the first length characters of str.
+//-----------------------------------------------------------------------------
+StringView toStringView(const char* str, size_t length)
+{
+    StringView view = {str, str == NULL ? 0 : length};
+
+    return view;
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in] builder  
+//!
+//! @return view of the string built by builder. It's valid until builder is
+//!         changed.
+//-----------------------------------------------------------------------------
+StringView toStringView(const StringBuilder* builder)
+{
+    StringView view = {};
+    if (builder != NULL)
+    {
+        view.str    = builder->str;
+        view.length = builder->length;
+    }
+
+    return view;
+}
+
+//-----------------------------------------------------------------------------
+//! @param [in] str  
+//!
+//! @return number of characters in str.
+//-----------------------------------------------------------------------------
+size_t strLength (StringView str)
+{
+    return str.length;
+}
+
+//-----------------------------------------------------------------------------
+//! Compares two strings. Characters equal to the string termination symbol
+//! are compared like any other ones.
+//!
+//! @param [in]  str1
+//! @param [in]  str2
+//!
+//! @return positive integer if str1 > str2, negative if str1 < str2
+//!         and 0 if str1 = str2
+//-----------------------------------------------------------------------------
+int strCompare (StringView str1, StringView str2)
+{
+    size_t commonLength = str1.length < str2.length ? str1.length : str2.length;
+    if (commonLength > 0)
+    {
+        int result = memcmp(str1.str, str2.str, commonLength);
+        if (result != 0)
+            return result;
+    }
+
+    if (str1.length == str2.length)
+        return 0;
+
+    return str1.length > str2.length ? 1 : -1;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends source to the first destinationLength characters of destination 
+//! and adds the string termination symbol after it, but writes no more than
+//! maxLength characters to destination (including the string termination 
+//! symbol).
+//!
+//! @param [out]  destination
+//! @param [in]   destinationLength  length of the string in destination
+//! @param [in]   source
+//! @param [in]   maxLength          size of destination (typically 
+//!                                  sizeof(destination))
+//!
+//! @return pointer to the string termination symbol of destination or NULL if
+//!         source didn't fit (destination then contains as much of it as 
+//!         fits).
+//-----------------------------------------------------------------------------
+char* strConcatenate (char* destination, size_t destinationLength, StringView source, size_t maxLength)
+{
+    if (destination == NULL || destinationLength >= maxLength || 
+        (source.str == NULL && source.length != 0))
+        return NULL;
+
+    size_t toCopy = maxLength - 1 - destinationLength;
+    if (toCopy > source.length)
+        toCopy = source.length;
+
+    char* ptrDestination = destination + destinationLength;
+    if (toCopy > 0)
+    {
+        memcpy(ptrDestination, source.str, toCopy);
+        ptrDestination += toCopy;
+    }
+
+    *ptrDestination = STRING_TERMINATION;
+
+    if (toCopy < source.length)
+        return NULL;
+
+    return ptrDestination;
+}
+
+//-----------------------------------------------------------------------------
+//! Finds the first occurrence of substr in str and returns the pointer to it. 
+//!
+//! @param [in]  str
+//! @param [in]  substr  
+//!
+//! @return pointer to the first occurrence of substr in str or NULL on 
+//!         failure (an empty substr is never found, the same as with the 
+//!         char* versions).
+//-----------------------------------------------------------------------------
+char* strFind (StringView str, StringView substr)
+{
+    if (str.str == NULL || substr.str == NULL || substr.length == 0 || substr.length > str.length)
+        return NULL;
+
+    // candidates are found by the first character of substr
+    const char* current = str.str;
+    const char* last    = str.str + (str.length - substr.length);
+    while (current <= last)
+    {
+        current = (const char*) memchr(current, substr.str[0], (size_t) (last - current) + 1);
+        if (current == NULL)
+            return NULL;
+
+        if (memcmp(current + 1, substr.str + 1, substr.length - 1) == 0)
+            return (char*) current;
+
+        current++;
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+//! Counts how many instances of symbol are in str.
+//!
+//! @param [in]  str
+//! @param [in]  symbol 
+//!
+//! @return number of occurrences of symbol in string. On error returns 0.
+//-----------------------------------------------------------------------------
+size_t strNumOfOccurrences(StringView str, char symbol)
+{
+    if (str.str == NULL)
+        return 0;
+
+    size_t      numOfOccurrences = 0;
+    const char* current          = str.str;
+    const char* end              = str.str + str.length;
+    while ((current = (const char*) memchr(current, symbol, (size_t) (end - current))) != NULL)
+    {
+        numOfOccurrences++;
+        current++;
+    }
+
+    return numOfOccurrences;
+}
+
+//-----------------------------------------------------------------------------
+//! Appends str to builder.
+//!
+//! @param [in] builder
+//! @param [in] str
+//!
+//! @return 0 on success and -1 if an error occurred.
+//-----------------------------------------------------------------------------
+int appendString(StringBuilder* builder, StringView str)
+{
+    return appendString(builder, str.str, str.length);
+}
+
+//-----------------------------------------------------------------------------
+//! Writes str to file. Characters equal to the string termination symbol are
+//! written as well.
+//!
+//! @param [in] file  pointer to the file to which str is to be written
+//! @param [in] str   characters to be written to file
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int writeString(File* file, StringView str)
+{
+    if (file == NULL                             ||
+        file->cfile == NULL                      ||
+        (file->mode != 'w' && file->mode != 'a') ||
+        (str.str == NULL && str.length != 0))
+        return FILE_END;
+
+    if (str.length > 0 && writeBytes(file, str.str, str.length) != str.length)
+        return FILE_END;
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//! Writes line to file and adds '\n' after that.
+//!
+//! @param [in] file  pointer to the file to which line is to be written
+//! @param [in] line  characters to be written to file
+//!
+//! @return 0 on success and FILE_END on failure.
+//-----------------------------------------------------------------------------
+int writeLine(File* file, StringView line)
+{
+    if (writeString(file, line) == FILE_END || writeChar(file, '\n') == FILE_END)
+        return FILE_END;
 
-    return successfullyInterpreted;    
+    return 0;
 }
 
 //-----------------------------------------------------------------------------
-//! Writes formatted string to file. All %c, %d and %s from str are changed to
-//! char, int or char* string equivalents of args from ... respectively. 
+//! Tells whether or not ch is a punctuation mark or a digit.
 //!
-//! @param [in] file  pointer to the file to which string is to be written
-//! @param [in] str   pointer to a string containing format in which specifying
-//!                   how to interpret the arguments from ... 
-//! @param [in] ...   arguments
+//! @param [in]  ch
 //!
-//! @note The order of arguments from ... has to be the same as the order of
-//!       %c, %d or %s indicators in str.
+//! @return 1 if ch is a punctuation mark and 0 otherwise.
+//-----------------------------------------------------------------------------
+int isPunctuationMark(unsigned char ch)
+{
+    return (ch >= ' ' && ch <= '@') ||
+           (ch >= '[' && ch <= '`') ||
+           (ch >= '{' && ch <= 191);
+}
+
+//-----------------------------------------------------------------------------
+//! Tells whether or not ch is a latin letter.
 //!
-//! @return number of arguments successfully interpreted or -1 if an
-//!         error occurred.
+//! @param [in]  ch
+//!
+//! @return 1 if ch is a latin letter and 0 otherwise.
 //-----------------------------------------------------------------------------
-int writeFormatted(File* file, const char* str, ...)
+int isLatinLetter(unsigned char ch)
 {
-    va_list valist;
-    va_start(valist, str);
+    return (ch >= (unsigned char)'a' && ch <= (unsigned char)'z') || 
+           (ch >= (unsigned char)'A' && ch <= (unsigned char)'Z');
+}
 
-    return writeFormatted(file, str, valist);
+//-----------------------------------------------------------------------------
+//! Tells whether or not ch is a cyrillic letter.
+//!
+//! @param [in]  ch
+//!
+//! @return 1 if ch is a cyrillic letter and 0 otherwise.
+//-----------------------------------------------------------------------------
+int isCyrillicLetter(unsigned char ch)
+{
+    return (ch >= (unsigned char)'�' && ch <= (unsigned char)'�') || 
+           (ch >= (unsigned char)'�' && ch <= (unsigned char)'�');
 }
 
 //-----------------------------------------------------------------------------
-//! Reads the next char from stdin.
+//! Converts upper-case letters to lower-case. If ch is not an upper-case
+//! letter then return ch without any changes.
 //!
-//! @return next char or FILE_END if and error occurred.
+//! @param [in]  ch
+//!
+//! @return lower-case version of ch.
 //-----------------------------------------------------------------------------
-int consoleNextChar()
+unsigned char toLowerCase(unsigned char ch)
 {
-    int ch = getchar();
-    return ch == EOF ? FILE_END : ch;
+    if (ch >= 'A' && ch <= 'Z')
+        return 'a' + ch - 'A';
+
+    if (ch >= (unsigned char)'�' && ch <= (unsigned char)'�')
+        return (unsigned char)'�' + ch - (unsigned char)'�';
+
+    return ch;
 }
 
 //-----------------------------------------------------------------------------
-//! Reads the next (maxLength - 1) characters from stdin to line. Adds '\0' at
-//! the end of line.
+//! Opens a reader of delimiter-separated records (CSV, TSV etc.) from file.
+//! Records are separated by '\n' ("\r\n" is also accepted), fields are 
+//! separated by delimiter and can be enclosed in quote symbols, in which case
+//! they can contain delimiters, line breaks and escaped (doubled) quotes.
 //!
-//! @param [in] line       pointer to char* to which characters are to be read
-//! @param [in] maxLength  max number of characters to read 
-//!                        (typically sizeof (line))
+//! @param [in] file       pointer to the file opened in 'r' mode
+//! @param [in] delimiter  field delimiter (e.g. ',' or '\t')
+//! @param [in] quote      quote symbol (typically '"')
 //!
-//! @return line or NULL on failure.
+//! @note The reader uses the buffer of file, so file mustn't be read by other
+//!       functions while the reader is in use.
+//!
+//! @return a pointer to the CsvReader opened or NULL if an error occurred.
 //-----------------------------------------------------------------------------
-char* consoleNextLine(char* line, size_t maxLength)
+CsvReader* openCsvReader(File* file, char delimiter, char quote)
 {
-    if (line == NULL)
+    if (file == NULL || file->mode != 'r' || delimiter == '\n' || delimiter == quote)
         return NULL;
 
-    if (scanf("%s", line) != 1)
+    CsvReader* reader = (CsvReader*)calloc(1, sizeof(CsvReader));
+    if (reader == NULL)
         return NULL;
 
-    return line;
+    reader->file      = file;
+    reader->delimiter = delimiter;
+    reader->quote     = quote;
+
+    return reader;
 }
 
 //-----------------------------------------------------------------------------
-//! Writes ch to stdout. ch is converted to unsigned int.
+//! Opens a reader of comma-separated records from file. 
 //!
-//! @param [in] ch  character to be written to stdout
+//! @param [in] file  pointer to the file opened in 'r' mode
 //!
-//! @return ch or FILE_END on failure.
+//! @return a pointer to the CsvReader opened or NULL if an error occurred.
 //-----------------------------------------------------------------------------
-int consoleWriteChar(char ch)
+CsvReader* openCsvReader(File* file)
 {
-    File file;
-    file.cfile = stdout;
-    file.mode  = 'w';
-
-    return writeChar(&file, ch);
+    return openCsvReader(file, CSV_DEFAULT_DELIMITER, CSV_DEFAULT_QUOTE);
 }
 
 //-----------------------------------------------------------------------------
-//! Writes str to stdout.
-//!
-//! @param [in] str  characters to be written to stdout
+//! Closes the reader. Doesn't close the file it reads from.
 //!
-//! @return 0 on success and FILE_END on failure.
+//! @param [in] reader  pointer to the reader to be closed
 //-----------------------------------------------------------------------------
-int consoleWriteString(const char* str)
+void closeCsvReader(CsvReader* reader)
 {
-    File file;
-    file.cfile = stdout;
-    file.mode  = 'w';
+    if (reader == NULL)
+        return;
 
-    return writeString(&file, str);
+    free(reader->bounds);
+    free(reader->fields);
+    free(reader->carry);
+    free(reader);
 }
 
 //-----------------------------------------------------------------------------
-//! Writes line to stdout and adds '\n' after that.
-//!
-//! @param [in] line  characters to be written to stdout
+//! Appends bytesCount bytes from source to the carry buffer of reader, which
+//! holds records that don't fit in the file buffer.
 //!
-//! @return 0 on success and FILE_END on failure.
+//! @return 0 on success and -1 if memory couldn't be allocated.
 //-----------------------------------------------------------------------------
-int consoleWriteLine(const char* line)
+int csvCarry(CsvReader* reader, const unsigned char* source, size_t bytesCount)
 {
-    File file;
-    file.cfile = stdout;
-    file.mode  = 'w';
+    assert(reader);
 
-    return writeLine(&file, line);
+    if (bytesCount == 0)
+        return 0;
+
+    if (reader->carryLength + bytesCount > reader->carryCapacity)
+    {
+        size_t newCapacity = reader->carryCapacity == 0 ? BUFFER_SIZE : reader->carryCapacity;
+        while (newCapacity < reader->carryLength + bytesCount)
+            newCapacity *= 2;
+
+        char* newCarry = (char*)realloc(reader->carry, newCapacity);
+        if (newCarry == NULL)
+            return -1;
+
+        reader->carry         = newCarry;
+        reader->carryCapacity = newCapacity;
+    }
+
+    memcpy(reader->carry + reader->carryLength, source, bytesCount);
+    reader->carryLength += bytesCount;
+
+    return 0;
 }
 
 //-----------------------------------------------------------------------------
-//! Writes formatted string to stdout. All %c, %d and %s from str are changed to
-//! char, int or char* string equivalents of args from ... respectively. 
-//!
-//! @param [in] str   pointer to a string containing format in which specifying
-//!                   how to interpret the arguments from ... 
-//! @param [in] ...   arguments
-//!
-//! @note The order of arguments from ... has to be the same as the order of
-//!       %c, %d or %s indicators in str.
+//! Adds bounds of the next field of the current record to reader.
 //!
-//! @return number of arguments successfully interpreted or -1 if an
-//!         error occurred.
+//! @return 0 on success and -1 if memory couldn't be allocated.
 //-----------------------------------------------------------------------------
-int consoleWriteFormatted(const char* str, ...)
+int csvAddField(CsvReader* reader, size_t fieldsCount, size_t start, size_t end, size_t quotes)
 {
-    File file;
-    file.cfile = stdout;
-    file.mode  = 'w';
-    
-    va_list valist;
-    va_start(valist, str);
+    assert(reader);
+
+    if (fieldsCount == reader->fieldsCapacity)
+    {
+        size_t newCapacity = reader->fieldsCapacity == 0 ? 16 : reader->fieldsCapacity * 2;
+
+        CsvFieldBounds* newBounds = (CsvFieldBounds*)realloc(reader->bounds, newCapacity * sizeof(CsvFieldBounds));
+        if (newBounds == NULL)
+            return -1;
+        reader->bounds = newBounds;
+
+        CsvField* newFields = (CsvField*)realloc(reader->fields, newCapacity * sizeof(CsvField));
+        if (newFields == NULL)
+            return -1;
+        reader->fields = newFields;
+
+        reader->fieldsCapacity = newCapacity;
+    }
+
+    reader->bounds[fieldsCount].start  = start;
+    reader->bounds[fieldsCount].end    = end;
+    reader->bounds[fieldsCount].quotes = quotes;
 
-    return writeFormatted(&file, str, valist);
+    return 0;
 }
 
 //-----------------------------------------------------------------------------
-//! Calls consoleNextChar() until '\n' ("clears buffer of garbage")
+//! Builds a bitmask of positions of delimiter, quote and '\n' in the 
+//! bytesCount (at most 16) bytes starting at data.
 //-----------------------------------------------------------------------------
-void consoleMoveToNextLine()
+uint32_t csvSpecialMask(const unsigned char* data, size_t bytesCount, char delimiter, char quote)
 {
-    while (consoleNextChar() != '\n') ;
+    assert(data);
+
+#ifdef __SSE2__
+    if (bytesCount == 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) data);
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(delimiter)),
+                        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(quote)),
+                                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))));
+
+        return (uint32_t) _mm_movemask_epi8(found);
+    }
+#endif
+
+    uint32_t mask = 0;
+    for (size_t i = 0; i < bytesCount; i++)
+    {
+        if (data[i] == (unsigned char)delimiter ||
+            data[i] == (unsigned char)quote     ||
+            data[i] == '\n')
+            mask |= 1u << i;
+    }
+
+    return mask;
 }
 
 //-----------------------------------------------------------------------------
-//! @param [in]  value
-//!
-//! @return the number of digits in value (not counting the sign).
+//! Turns bounds of the current record into fields pointing to base. Removes
+//! enclosing quotes, unescapes doubled quotes (in place, so base has to be
+//! the carry buffer of reader if there are any) and removes '\r' before the
+//! record's '\n'.
 //-----------------------------------------------------------------------------
-size_t numberOfDigits (int value)
+void csvMakeFields(CsvReader* reader, char* base, size_t fieldsCount, int endedWithNewLine)
 {
-    size_t digits = 0;
-    int    temp   = value;
-    while (temp / 10 != 0)
+    assert(reader);
+
+    for (size_t i = 0; i < fieldsCount; i++)
     {
-        temp /= 10;
-        digits++;
-    }
+        CsvFieldBounds* bounds = &reader->bounds[i];
 
-    return digits + 1;
+        char*  str    = base + bounds->start;
+        size_t length = bounds->end - bounds->start;
+
+        if (i == fieldsCount - 1 && endedWithNewLine && length > 0 && str[length - 1] == '\r')
+            length--;
+
+        if (bounds->quotes >= 2 && length >= 2 && 
+            str[0] == reader->quote && str[length - 1] == reader->quote)
+        {
+            str++;
+            length -= 2;
+
+            if (bounds->quotes > 2)
+            {
+                size_t unescapedLength = 0;
+                for (size_t j = 0; j < length; j++, unescapedLength++)
+                {
+                    if (str[j] == reader->quote && j + 1 < length && str[j + 1] == reader->quote)
+                        j++;
+
+                    str[unescapedLength] = str[j];
+                }
+
+                length = unescapedLength;
+            }
+        }
+
+        reader->fields[i].str    = str;
+        reader->fields[i].length = length;
+    }
 }
 
 //-----------------------------------------------------------------------------
-//! Converts int to string. 
+//! Reads the next record from reader. Delimiters, quotes and line breaks are 
+//! located with a single (vectorized where possible) pass over the file 
+//! buffer. Fields point directly into the buffer of the file unless the 
+//! record crosses the end of the buffer, in which case the record is copied
+//! to an internal buffer of reader. Records with escaped quotes are copied to
+//! that buffer as well and unescaped there, so the file buffer is never 
+//! changed.
 //!
-//! @param [in]  value   value to be converted
-//! @param [out] str     string to which to write result
-//! @param [in]  digits  number of digits of value (not counting the sign)
+//! @param [in]  reader       pointer to the reader
+//! @param [out] fieldsCount  number of fields in the record read
 //!
-//! @return str or NULL on failure.
+//! @note Fields are not terminated with STRING_TERMINATION (use csvFieldToStr
+//!       if necessary) and are only valid until the next call of 
+//!       nextCsvRecord or closeCsvReader.
+//!
+//! @return array of fieldsCount fields or NULL if the end of file has been 
+//!         reached or an error occurred.
 //-----------------------------------------------------------------------------
-char* intToStr (int value, char* str, size_t digits)
+const CsvField* nextCsvRecord(CsvReader* reader, size_t* fieldsCount)
 {
-    if (str == NULL)
+    if (reader == NULL || fieldsCount == NULL)
         return NULL;
 
-    int i = 0;
-    if (value < 0)
+    File* file = reader->file;
+    if (file->fileEndReached)
+        return NULL;
+
+    reader->carryLength = 0;
+
+    size_t count            = 0;
+    size_t fieldStart       = 0;
+    size_t quotes           = 0;
+    int    inQuotes         = 0;
+    int    recordEnded      = 0;
+    size_t segmentStart     = file->position;
+
+    while (!recordEnded)
     {
-        str[0] = '-';
-        i = 1;
-        value = -value;
+        if (file->position >= file->correctBufferValues)
+        {
+            if (segmentStart < file->correctBufferValues &&
+                csvCarry(reader, file->buffer + segmentStart, file->correctBufferValues - segmentStart) != 0)
+                return NULL;
+
+            if (file->position < BUFFER_SIZE || 
+                updateBuffer(file) != 0      || 
+                file->correctBufferValues == 0)
+            {
+                file->fileEndReached = 1;
+                break;
+            }
+
+            segmentStart = 0;
+        }
+
+        // logical offset of byte i of the file buffer from the record start
+        size_t logicalBase = reader->carryLength - segmentStart;
+
+        size_t i   = file->position;
+        size_t end = file->correctBufferValues;
+        while (i < end && !recordEnded)
+        {
+            size_t   chunk = end - i < 16 ? end - i : 16;
+            uint32_t mask  = csvSpecialMask(file->buffer + i, chunk, reader->delimiter, reader->quote);
+
+            while (mask != 0)
+            {
+                size_t index = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+
+                if (file->buffer[index] == (unsigned char)reader->quote)
+                {
+                    inQuotes = !inQuotes;
+                    quotes++;
+                    continue;
+                }
+
+                if (inQuotes)
+                    continue;
+
+                if (csvAddField(reader, count++, fieldStart, logicalBase + index, quotes) != 0)
+                    return NULL;
+
+                quotes     = 0;
+                fieldStart = logicalBase + index + 1;
+
+                if (file->buffer[index] == '\n')
+                {
+                    recordEnded    = 1;
+                    file->position = index + 1;
+                    break;
+                }
+            }
+
+            i += chunk;
+        }
+
+        if (!recordEnded)
+            file->position = end;
     }
 
-    int currentDigit = 0;
-    for (int tensPower = lround(pow(10, digits - 1)); 
-         tensPower >= 1; 
-         tensPower /= 10, i++)
+    char* base = (char*) file->buffer + segmentStart;
+    if (reader->carryLength > 0)
     {
-        currentDigit = (value / tensPower) % 10;
+        if (recordEnded && 
+            csvCarry(reader, file->buffer + segmentStart, file->position - segmentStart) != 0)
+            return NULL;
 
-        str[i] = '0' + currentDigit;
+        base = reader->carry;
     }
 
-    str[i] = STRING_TERMINATION;
+    if (!recordEnded)
+    {
+        // the last record of file doesn't end with '\n'
+        if (reader->carryLength == 0 && count == 0)
+            return NULL;
 
-    return str;
+        if (csvAddField(reader, count++, fieldStart, reader->carryLength, quotes) != 0)
+            return NULL;
+    }
+
+    if (reader->carryLength == 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (reader->bounds[i].quotes <= 2)
+                continue;
+
+            if (csvCarry(reader, (const unsigned char*) base, reader->bounds[count - 1].end) != 0)
+                return NULL;
+
+            base = reader->carry;
+            break;
+        }
+    }
+
+    csvMakeFields(reader, base, count, recordEnded);
+
+    *fieldsCount = count;
+
+    return reader->fields;
 }
 
 //-----------------------------------------------------------------------------
-//! Converts int to string. 
+//! Converts field to int.
 //!
-//! @param [in]  value  value to be converted
-//! @param [out] str    string to which to write result
+//! @param [in]  field  
+//! @param [out] value  result
 //!
-//! @return str or NULL on failure.
+//! @return 0 on success and -1 if field is not a valid int.
 //-----------------------------------------------------------------------------
-char* intToStr (int value, char* str)
+int csvFieldToInt(const CsvField* field, int* value)
 {
-    return intToStr(value, str, numberOfDigits(value));
+    if (field == NULL)
+        return -1;
+
+    return strToInt(field->str, field->length, value);
 }
 
 //-----------------------------------------------------------------------------
-//! Calculates the length of str (not including the string termination symbol). 
+//! Copies the first (maxLength - 1) characters of field to str and adds 
+//! STRING_TERMINATION at the end.
 //!
-//! @param [in]  str  
+//! @param [in]  field  
+//! @param [out] str        
+//! @param [in]  maxLength  max number of characters to write (typically 
+//!                         sizeof (str))
 //!
-//! @return number of characters in str or 0 on failure.
+//! @return str or NULL on failure.
 //-----------------------------------------------------------------------------
-size_t strLength (const char* str)
+char* csvFieldToStr(const CsvField* field, char* str, size_t maxLength)
 {
-    if (str == NULL)
-        return 0;
+    if (field == NULL || str == NULL || maxLength == 0)
+        return NULL;
 
-    size_t length = 0;
-    for (char* currentSymbol = (char*) str; *currentSymbol != STRING_TERMINATION; currentSymbol++)
-        length++;
+    size_t length = field->length < maxLength - 1 ? field->length : maxLength - 1;
+    memcpy(str, field->str, length);
+    str[length] = STRING_TERMINATION;
 
-    return length;
+    return str;
 }
 
 //-----------------------------------------------------------------------------
-//! Compares two strings.
-//! @param [in]  str1
-//! @param [in]  str2
-//! @return positive integer if str1 > str2, negative if str1 < str2
-//!         and 0 if str1 = str2
+//! Stores args of format to slot in a compact form: 1 byte for %c, 4 bytes
+//! for %d and 2 bytes of length followed by the characters for %s. Strings 
+//! that don't fit into the slot are truncated, NULL strings are stored as
+//! LOG_NULL_STRING length without characters.
 //-----------------------------------------------------------------------------
-int strCompare (const unsigned char* str1, const unsigned char* str2)
+void encodeLogArgs(LogSlot* slot, const char* format, va_list valist)
 {
-    assert(str1);
-    assert(str2);
+    assert(slot);
+    assert(format);
 
-    unsigned char* ptr1 = (unsigned char*) str1;
-    unsigned char* ptr2 = (unsigned char*) str2;
-    while (*ptr1 == *ptr2)
+    unsigned char* args       = slot->args;
+    size_t         argsLength = 0;
+
+    for (const char* currentChar = format; *currentChar != STRING_TERMINATION; currentChar++)
     {
-        if (*ptr1 == STRING_TERMINATION) 
-            return 0;
+        if (*currentChar != '%')
+            continue;
 
-        ptr1++;
-        ptr2++;
+        currentChar++;
+        if (*currentChar == STRING_TERMINATION)
+            break;
+
+        if (*currentChar == 'c')
+        {
+            char value = (char) va_arg(valist, int);
+            if (argsLength + 1 <= LOG_ARGS_SIZE)
+                args[argsLength++] = (unsigned char) value;
+        }
+        else if (*currentChar == 'd')
+        {
+            int value = va_arg(valist, int);
+            if (argsLength + sizeof(int) <= LOG_ARGS_SIZE)
+            {
+                memcpy(args + argsLength, &value, sizeof(int));
+                argsLength += sizeof(int);
+            }
+        }
+        else if (*currentChar == 's')
+        {
+            const char* value = va_arg(valist, const char*);
+            if (argsLength + sizeof(uint16_t) > LOG_ARGS_SIZE)
+                continue;
+
+            if (value == NULL)
+            {
+                memcpy(args + argsLength, &LOG_NULL_STRING, sizeof(uint16_t));
+                argsLength += sizeof(uint16_t);
+                continue;
+            }
+
+            uint16_t length = 0;
+            size_t   space  = LOG_ARGS_SIZE - argsLength - sizeof(uint16_t);
+            while (length < space && value[length] != STRING_TERMINATION)
+                length++;
+
+            memcpy(args + argsLength, &length, sizeof(uint16_t));
+            memcpy(args + argsLength + sizeof(uint16_t), value, length);
+            argsLength += sizeof(uint16_t) + length;
+        }
     }
 
-    return *ptr1 - *ptr2;
+    slot->argsLength = (uint32_t) argsLength;
 }
 
 //-----------------------------------------------------------------------------
-//! Appends the content of source to destination. Undefined behavior if there's
-//! not enough space in destination. 
-//!
-//! @param [out]  destination
-//! @param [in]   source
-//!
-//! @return destination
+//! Writes the batch of formatted records of logger to its file. A failure is
+//! recorded in logger and reported by closeLogger.
 //-----------------------------------------------------------------------------
-char* strConcatenate (char* destination, const char* source)
+void flushLogBatch(Logger* logger)
 {
-    if (destination == NULL)
-        return NULL;
-    if (source == NULL)
-        return destination;
-
-    char* ptrDestination = destination;
-    while (*ptrDestination != STRING_TERMINATION) ptrDestination++;
+    assert(logger);
 
-    for (char* ptrSource = (char*) source; *ptrSource != STRING_TERMINATION; ptrSource++, ptrDestination++)
-        *ptrDestination = *ptrSource;
+    if (logger->batchLength > 0 &&
+        writeBytes(logger->file, logger->batch, logger->batchLength) != logger->batchLength)
+        logger->writeFailed = 1;
 
-    *ptrDestination = STRING_TERMINATION;
-    
-    return ptrDestination;
+    logger->batchLength = 0;
+    if (fflush(logger->file->cfile) != 0)
+        logger->writeFailed = 1;
 }
 
 //-----------------------------------------------------------------------------
-//! Finds the firt occurrence of substr in str and returns the pointer to it. 
-//!
-//! @param [in]  str
-//! @param [in]  substr  
+//! Appends data of a format sink to the batch of a logger (the target of the
+//! sink, the batch is the buffer of the sink). The batch is written to the 
+//! file of the logger when it's full. 
 //!
-//! @return pointer to the first occurrence of substr in str or NULL on 
-//!         failure.
+//! @return 0 on success and -1 if writing to the file failed (the failure is
+//!         recorded in the logger).
 //-----------------------------------------------------------------------------
-char* strFind (const char* str, const char* substr)
+int logSinkWrite(FormatSink* sink, const char* data, size_t length)
 {
-    if (str == NULL || substr == NULL)
-        return NULL;
+    Logger* logger = (Logger*) sink->target;
+    File*   file   = logger->file;
 
-    size_t substrLength = strLength(substr);
-    
-    int    start            = -1;
-    size_t currentlyMatched = 0;
-    for (size_t currentIndex = 0; str[currentIndex] != STRING_TERMINATION; currentIndex++)
+    if (length > sink->capacity - sink->used)
     {
-        if (currentlyMatched == substrLength)
-            break;
-        
-        if (substr[currentlyMatched] == STRING_TERMINATION)
-            return NULL;
+        if (writeBytes(file, sink->buffer, sink->used) != sink->used)
+            logger->writeFailed = 1;
 
-        if (str[currentIndex] == substr[currentlyMatched])
-        {
-            if (start == -1)
-                start = currentIndex;
+        sink->used = 0;
+    }
 
-            currentlyMatched++;
-        } 
-        else
-        {
-            start            = -1;
-            currentlyMatched = 0;
-        }
+    if (length >= sink->capacity)
+    {
+        if (writeBytes(file, data, length) == length)
+            return 0;
+
+        logger->writeFailed = 1;
+        return -1;
     }
 
-    if (start == -1)
-        return NULL;
+    memcpy(sink->buffer + sink->used, data, length);
+    sink->used += length;
 
-    return (char*)&str[start];
+    return 0;
 }
 
 //-----------------------------------------------------------------------------
-//! Finds the firt occurrence of substr in str and returns the pointer to it. 
-//! Checks only first maxSymbolsToCheck symbols of str.
-//!
-//! @param [in]  str
-//! @param [in]  substr 
-//! @param [in]  maxSymbolsToCheck
+//! Takes the next argument of type from the args encoded by encodeLogArgs. 
+//! Arguments that didn't fit into the slot are formatted as empty.
 //!
-//! @return pointer to the first occurrence of substr in str or NULL on 
-//!         failure.
+//! @return 0 on success and -1 if a %s argument is NULL.
 //-----------------------------------------------------------------------------
-char* strFind (const char* str, const char* substr, size_t maxSymbolsToCheck)
+int nextLogArg(FormatArgs* args, char type, char* scratch, StringView* text)
 {
-    if (str == NULL || substr == NULL)
-        return NULL;
-
-    size_t substrLength     = strLength(substr);
+    const unsigned char* encoded = args->encoded + args->encodedRead;
+    size_t               left    = args->encodedLength - args->encodedRead;
 
-    int    start            = -1;
-    size_t currentlyMatched = 0;
-    for (size_t currentIndex = 0; str[currentIndex] != STRING_TERMINATION && currentIndex < maxSymbolsToCheck; currentIndex++)
+    switch (type)
     {
-        if (currentlyMatched == substrLength)
-            break;
+        case 'c':
+        if (left < 1)
+            return 0;
 
-        if (substr[currentlyMatched] == STRING_TERMINATION)
-            return NULL;
+        scratch[0]   = (char) encoded[0];
+        text->str    = scratch;
+        text->length = 1;
+        args->encodedRead++;
+        return 0;
 
-        if (str[currentIndex] == substr[currentlyMatched])
+        case 'd':
         {
-            if (start == -1)
-                start = currentIndex;
+            if (left < sizeof(int))
+                return 0;
 
-            currentlyMatched++;
-        } 
-        else
+            int value = 0;
+            memcpy(&value, encoded, sizeof(int));
+            text->str    = scratch;
+            text->length = intToChars(value, scratch);
+            args->encodedRead += sizeof(int);
+            return 0;
+        }
+
+        case 's':
         {
-            start            = -1;
-            currentlyMatched = 0;
+            if (left < sizeof(uint16_t))
+                return 0;
+
+            uint16_t length = 0;
+            memcpy(&length, encoded, sizeof(uint16_t));
+            if (length == LOG_NULL_STRING)
+                return -1;
+
+            text->str    = (const char*) encoded + sizeof(uint16_t);
+            text->length = length;
+            args->encodedRead += sizeof(uint16_t) + length;
+            return 0;
         }
     }
 
-    if (currentlyMatched != substrLength)
-        return NULL;
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+//! Formats the record in slot with formatToSink, the same way writeFormatted
+//! does, and appends it to the batch of logger.
+//-----------------------------------------------------------------------------
+void formatLogRecord(Logger* logger, const LogSlot* slot)
+{
+    assert(logger);
+    assert(slot);
+
+    FormatSink sink = {};
+    sink.write    = logSinkWrite;
+    sink.target   = logger;
+    sink.buffer   = logger->batch;
+    sink.capacity = LOG_BATCH_SIZE;
+    sink.used     = logger->batchLength;
 
-    return (char*)&str[start];
+    FormatArgs args = {};
+    args.next          = nextLogArg;
+    args.encoded       = slot->args;
+    args.encodedLength = slot->argsLength;
+
+    formatToSink(&sink, slot->format, &args);
+    logger->batchLength = sink.used;
 }
 
 //-----------------------------------------------------------------------------
-//! Counts how many instances of symbol are in str.
-//!
-//! @param [in]  str
-//! @param [in]  symbol 
-//!
-//! @return number of occurrences of symbol in string. On error returns 0.
+//! Main function of the background thread of logger. Takes records from the
+//! queue, formats them and writes them to the file in large batches.
 //-----------------------------------------------------------------------------
-size_t strNumOfOccurrences(const char* str, char symbol)
+void runLogger(Logger* logger)
 {
-    if (str == NULL)
-        return 0;
-    
-    size_t numOfOccurrences = 0;
-    for(; *str != STRING_TERMINATION; str++)
-        if (*str == symbol)
-            numOfOccurrences++;
+    assert(logger);
 
-    return numOfOccurrences;
+    size_t mask     = logger->capacity - 1;
+    size_t position = logger->dequeuePosition.load(std::memory_order_relaxed);
+    size_t idleRuns = 0;
+
+    while (true)
+    {
+        LogSlot* slot = &logger->slots[position & mask];
+        if (slot->sequence.load(std::memory_order_acquire) == position + 1)
+        {
+            formatLogRecord(logger, slot);
+
+            slot->sequence.store(position + logger->capacity, std::memory_order_release);
+            position++;
+            logger->dequeuePosition.store(position, std::memory_order_relaxed);
+
+            idleRuns = 0;
+            continue;
+        }
+
+        size_t drops = logger->dropsCount.load(std::memory_order_relaxed);
+        if (logger->overflowPolicy == LOG_OVERFLOW_COUNT && drops != logger->dropsReported)
+        {
+            // a count that doesn't fit into int is reported by several notices
+            size_t dropped = drops - logger->dropsReported;
+            if (dropped > INT_MAX)
+                dropped = INT_MAX;
+
+            flushLogBatch(logger);
+            if (writeFormatted(logger->file, "[ioLib logger: %d records dropped]\n", (int) dropped) < 0)
+                logger->writeFailed = 1;
+
+            logger->dropsReported += dropped;
+            continue;
+        }
+
+        if (idleRuns == 0)
+            flushLogBatch(logger);
+
+        if (!logger->running.load(std::memory_order_acquire) &&
+            logger->enqueuePosition.load(std::memory_order_acquire) == position)
+            break;
+
+        if (++idleRuns < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    flushLogBatch(logger);
 }
 
 //-----------------------------------------------------------------------------
-//! Counts how many instances of symbol are in str, but checks only
-//! maxSymbolsToCheck symbols.
+//! Opens an asynchronous logger writing to file. Records are put to a 
+//! lock-free queue by logFormatted and formatted and written to file by a
+//! background thread.
 //!
-//! @param [in]  str
-//! @param [in]  symbol 
-//! @param [in]  maxSymbolsToCheck 
+//! @param [in] file            pointer to the file opened in 'w' or 'a' mode
+//! @param [in] queueCapacity   max number of records in the queue (rounded 
+//!                             up to a power of two)
+//! @param [in] overflowPolicy  what logFormatted does if the queue is full:
+//!                             LOG_OVERFLOW_BLOCK - waits for free space;
+//!                             LOG_OVERFLOW_DROP  - drops the record;
+//!                             LOG_OVERFLOW_COUNT - drops the record, the 
+//!                                                  number of records dropped
+//!                                                  is written to the log
 //!
-//! @return number of occurrences of symbol in first maxSymbolsToCheck symbols
-//!         of string. On error returns 0.
+//! @note file mustn't be written to by other functions until the logger is
+//!       closed.
+//!
+//! @return a pointer to the Logger opened or NULL if an error occurred.
 //-----------------------------------------------------------------------------
-size_t strNumOfOccurrences(const char* str, char symbol, size_t maxSymbolsToCheck)
+Logger* openLogger(File* file, size_t queueCapacity, int overflowPolicy)
 {
-    if (str == NULL)
-        return 0;
+    if (file        == NULL ||
+        file->cfile == NULL ||
+        (file->mode != 'w' && file->mode != 'a'))
+        return NULL;
 
-    size_t numOfOccurrences = 0;
-    size_t symbolsChecked   = 0;
-    for(; *str != STRING_TERMINATION && symbolsChecked < maxSymbolsToCheck; str++, symbolsChecked++)
-        if (*str == symbol)
-            numOfOccurrences++;
+    if (overflowPolicy != LOG_OVERFLOW_BLOCK &&
+        overflowPolicy != LOG_OVERFLOW_DROP  &&
+        overflowPolicy != LOG_OVERFLOW_COUNT)
+        return NULL;
 
-    return numOfOccurrences;
+    Logger* logger = new (std::nothrow) Logger;
+    if (logger == NULL)
+        return NULL;
+
+    logger->file           = file;
+    logger->overflowPolicy = overflowPolicy;
+
+    logger->capacity = 2;
+    while (logger->capacity < queueCapacity)
+        logger->capacity *= 2;
+
+    logger->slots = new (std::nothrow) LogSlot[logger->capacity];
+    logger->batch = (char*)malloc(LOG_BATCH_SIZE);
+    if (logger->slots == NULL || logger->batch == NULL)
+    {
+        delete[] logger->slots;
+        free(logger->batch);
+        delete logger;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < logger->capacity; i++)
+        logger->slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    logger->running.store(1, std::memory_order_release);
+    try
+    {
+        logger->consumer = std::thread(runLogger, logger);
+    }
+    catch (const std::system_error&)
+    {
+        delete[] logger->slots;
+        free(logger->batch);
+        delete logger;
+        return NULL;
+    }
+
+    return logger;
 }
 
 //-----------------------------------------------------------------------------
-//! Tells whether or not ch is a punctuation mark or a digit.
+//! Writes all the records left in the queue of logger and closes it. Doesn't
+//! close the file logger writes to.
 //!
-//! @param [in]  ch
+//! @param [in] logger  pointer to the logger to be closed
 //!
-//! @return 1 if ch is a punctuation mark and 0 otherwise.
+//! @return 0 on success and -1 if writing any of the records to the file has
+//!         failed.
 //-----------------------------------------------------------------------------
-int isPunctuationMark(unsigned char ch)
+int closeLogger(Logger* logger)
 {
-    return (ch >= ' ' && ch <= '@') ||
-           (ch >= '[' && ch <= '`') ||
-           (ch >= '{' && ch <= 191);
+    if (logger == NULL)
+        return -1;
+
+    logger->running.store(0, std::memory_order_release);
+    logger->consumer.join();
+
+    int result = logger->writeFailed ? -1 : 0;
+
+    delete[] logger->slots;
+    free(logger->batch);
+    delete logger;
+
+    return result;
 }
 
 //-----------------------------------------------------------------------------
-//! Tells whether or not ch is a latin letter.
+//! Puts a record to the queue of logger. The record is formatted later by 
+//! the background thread of logger exactly as writeFormatted would format it.
+//! Only the pointer to format and the values of arguments are stored, so
+//! format has to stay valid until the logger is closed (typically it's a 
+//! string literal).
 //!
-//! @param [in]  ch
+//! @param [in] logger  pointer to the logger
+//! @param [in] format  pointer to a string containing format in which 
+//!                     specifying how to interpret the arguments from ... 
+//! @param [in] ...     arguments
 //!
-//! @return 1 if ch is a latin letter and 0 otherwise.
+//! @note Strings from ... are copied and truncated if the record takes more
+//!       than LOG_ARGS_SIZE bytes.
+//!
+//! @return 0 on success and -1 if the record has been dropped or an error 
+//!         occurred.
 //-----------------------------------------------------------------------------
-int isLatinLetter(unsigned char ch)
+int logFormatted(Logger* logger, const char* format, ...)
 {
-    return (ch >= (unsigned char)'a' && ch <= (unsigned char)'z') || 
-           (ch >= (unsigned char)'A' && ch <= (unsigned char)'Z');
+    if (logger == NULL || format == NULL)
+        return -1;
+
+    size_t   mask     = logger->capacity - 1;
+    size_t   position = logger->enqueuePosition.load(std::memory_order_relaxed);
+    LogSlot* slot     = NULL;
+
+    while (true)
+    {
+        slot = &logger->slots[position & mask];
+
+        size_t   sequence   = slot->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+        if (difference == 0)
+        {
+            if (logger->enqueuePosition.compare_exchange_weak(position, position + 1, 
+                                                               std::memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            // the queue is full
+            if (logger->overflowPolicy != LOG_OVERFLOW_BLOCK)
+            {
+                logger->dropsCount.fetch_add(1, std::memory_order_relaxed);
+                return -1;
+            }
+
+            std::this_thread::yield();
+            position = logger->enqueuePosition.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            position = logger->enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->format = format;
+
+    va_list valist;
+    va_start(valist, format);
+    encodeLogArgs(slot, format, valist);
+    va_end(valist);
+
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    return 0;
 }
 
 //-----------------------------------------------------------------------------
-//! Tells whether or not ch is a cyrillic letter.
-//!
-//! @param [in]  ch
+//! @param [in] logger  pointer to the logger
 //!
-//! @return 1 if ch is a cyrillic letter and 0 otherwise.
+//! @return number of records in the queue of logger waiting to be written.
 //-----------------------------------------------------------------------------
-int isCyrillicLetter(unsigned char ch)
+size_t getLoggerQueueDepth(Logger* logger)
 {
-    return (ch >= (unsigned char)'�' && ch <= (unsigned char)'�') || 
-           (ch >= (unsigned char)'�' && ch <= (unsigned char)'�');
+    if (logger == NULL)
+        return 0;
+
+    size_t dequeued = logger->dequeuePosition.load(std::memory_order_relaxed);
+    size_t enqueued = logger->enqueuePosition.load(std::memory_order_relaxed);
+
+    return enqueued > dequeued ? enqueued - dequeued : 0;
 }
 
 //-----------------------------------------------------------------------------
-//! Converts upper-case letters to lower-case. If ch is not an upper-case
-//! letter then return ch without any changes.
-//!
-//! @param [in]  ch
+//! @param [in] logger  pointer to the logger
 //!
-//! @return lower-case version of ch.
+//! @return number of records dropped by logger because its queue was full.
 //-----------------------------------------------------------------------------
-unsigned char toLowerCase(unsigned char ch)
+size_t getLoggerDropsCount(Logger* logger)
 {
-    if (ch >= 'A' && ch <= 'Z')
-        return 'a' + ch - 'A';
-
-    if (ch >= (unsigned char)'�' && ch <= (unsigned char)'�')
-        return (unsigned char)'�' + ch - (unsigned char)'�';
+    if (logger == NULL)
+        return 0;
 
-    return ch;
+    return logger->dropsCount.load(std::memory_order_relaxed);
 }
\ No newline at end of file
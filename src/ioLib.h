@@ -1,15 +1,82 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 
 constexpr size_t BUFFER_SIZE          = 512;
 constexpr int    FILE_END             = -1;
 constexpr int    UPDATE_BUFFER_DENIED = -1;
 
+constexpr int    OPEN_COMPRESSED      = 1;
+
+constexpr size_t SMALL_FILE_MAX_SIZE  = 64 * 1024;
+
+constexpr int    SEEK_FROM_BEGIN      = 0;
+constexpr int    SEEK_FROM_CURRENT    = 1;
+constexpr int    SEEK_FROM_END        = 2;
+
+constexpr int    DURABILITY_NONE         = 0;
+constexpr int    DURABILITY_PER_RECORD   = 1;
+constexpr int    DURABILITY_GROUP_COMMIT = 2;
+
+constexpr int    LOG_OVERFLOW_BLOCK   = 0;
+constexpr int    LOG_OVERFLOW_DROP    = 1;
+constexpr int    LOG_OVERFLOW_COUNT   = 2;
+
+constexpr int    CHECKSUM_NONE        = 0;
+constexpr int    CHECKSUM_CRC32C      = 1;
+constexpr int    CHECKSUM_XXHASH64    = 2;
+
+constexpr char   CSV_DEFAULT_DELIMITER = ',';
+constexpr char   CSV_DEFAULT_QUOTE     = '"';
+
+constexpr size_t STRING_BUILDER_INLINE_SIZE = 128;
+
 struct File;
+struct CsvReader;
+struct Logger;
+
+struct IoVector
+{
+    const void* data;
+    size_t      length;
+};
+
+struct DurabilityStats
+{
+    size_t   recordsCount;
+    size_t   syncsCount;
+    uint64_t p50Microseconds;
+    uint64_t p90Microseconds;
+    uint64_t p99Microseconds;
+    uint64_t p999Microseconds;
+    uint64_t maxMicroseconds;
+};
+
+struct StringView
+{
+    const char* str;
+    size_t      length;
+};
+
+typedef StringView CsvField;
+
+typedef int (*FormatCallback)(const char* data, size_t length, void* context);
+
+struct StringBuilder
+{
+    char*  str;
+    size_t length;
+    size_t capacity;
+    char   inlineBuffer[STRING_BUILDER_INLINE_SIZE];
+};
 
 File*    openFile              (const char* fileName, const char mode);
-void     closeFile             (File* file);
+File*    openFile              (const char* fileName, const char mode, int flags);
+int      closeFile             (File* file);
+StringView readSmallFile       (const char* fileName);
+void     releaseSmallFile      (StringView contents);
+void     clearFilePool         ();
 void     setStringTermination  (char terminationSymbol);
 char     getStringTermination  ();
 size_t   readBufferFromFile    (File* file, size_t typeSize, size_t count, void* buffer);
@@ -17,10 +84,31 @@ size_t   writeBufferToFile     (File* file, size_t typeSize, size_t count, void*
 void*    memoryCopy            (void* destination, const void* source, size_t bytesCount);
 int      nextChar              (File* file);
 char*    nextLine              (File* file, char* line, size_t maxLength);
+char*    nextLine              (File* file, char* line, size_t maxLength, size_t* length);
+int      seekFile              (File* file, int64_t offset, int origin);
+int64_t  tellFile              (File* file);
+size_t   readAt                (File* file, int64_t offset, size_t length, void* destination);
+int      setBlockCache         (size_t blockSize, size_t blocksCount);
+void     clearBlockCache       ();
 int      writeChar             (File* file, char ch);
 int      writeString           (File* file, const char* str);
 int      writeLine             (File* file, const char* line);
+int      writeLines            (File* file, const char* const* lines, size_t count);
+int      writeGathered         (File* file, const IoVector* vectors, size_t count);
+int64_t  copyFileRange         (File* source, File* destination, int64_t offset, int64_t length);
+int64_t  appendFile            (File* destination, File* source);
+int      setDurabilityPolicy   (File* file, int policy, unsigned int groupMilliseconds, size_t groupBytes);
+int      commitRecord          (File* file);
+int      getDurabilityStats    (File* file, DurabilityStats* stats);
+int      setFileChecksum       (File* file, int type);
+int      verifyFileChecksum    (File* file, uint64_t expected);
+uint64_t getFileChecksum       (File* file);
+size_t   getFileBlocksCount    (File* file);
+int64_t  getFileBlockOffset    (File* file, size_t blockNumber);
 int      writeFormatted        (File* file, const char* str, ...);
+int      formatToBuffer        (char* buffer, size_t bufferSize, size_t* length, const char* format, ...);
+int      formatToCallback      (FormatCallback callback, void* context, const char* format, ...);
+size_t   formattedSize         (const char* format, ...);
 int      consoleNextChar       ();
 char*    consoleNextLine       (char* line, size_t maxLength);
 int      consoleWriteChar      (char ch);
@@ -28,18 +116,56 @@ int      consoleWriteString    (const char* str);
 int      consoleWriteLine      (const char* line);
 int      consoleWriteFormatted (const char* str, ...);
 void     consoleMoveToNextLine ();
+
+Logger*  openLogger            (File* file, size_t queueCapacity, int overflowPolicy);
+int      closeLogger           (Logger* logger);
+int      logFormatted          (Logger* logger, const char* format, ...);
+size_t   getLoggerQueueDepth   (Logger* logger);
+size_t   getLoggerDropsCount   (Logger* logger);
          
+CsvReader* openCsvReader       (File* file, char delimiter, char quote);
+CsvReader* openCsvReader       (File* file);
+void     closeCsvReader        (CsvReader* reader);
+const 
+CsvField* nextCsvRecord        (CsvReader* reader, size_t* fieldsCount);
+int      csvFieldToInt         (const CsvField* field, int* value);
+char*    csvFieldToStr         (const CsvField* field, char* str, size_t maxLength);
+
 size_t   numberOfDigits        (int value);
 char*    intToStr              (int value, char* str, size_t digits);
 char*    intToStr              (int value, char* str);
+int      strToInt              (const char* str, size_t length, int* value);
 size_t   strLength             (const char* str);
 int      strCompare            (const unsigned char* str1, const unsigned char* str2);
 char*    strConcatenate        (char* destination, const char* source);
+char*    strConcatenate        (char* destination, const char* source, size_t maxLength);
 char*    strFind               (const char* str, const char* substr);
 char*    strFind               (const char* str, const char* substr, size_t maxSymbolsToCheck);
 size_t   strNumOfOccurrences   (const char* str, char symbol);
 size_t   strNumOfOccurrences   (const char* str, char symbol, size_t maxSymbolsToCheck);
 
+void     initStringBuilder     (StringBuilder* builder);
+void     destroyStringBuilder  (StringBuilder* builder);
+void     clearStringBuilder    (StringBuilder* builder);
+int      appendString          (StringBuilder* builder, const char* str, size_t length);
+int      appendString          (StringBuilder* builder, const char* str);
+int      appendChar            (StringBuilder* builder, char ch);
+int      appendInt             (StringBuilder* builder, int value);
+int      appendFormatted       (StringBuilder* builder, const char* format, ...);
+int      writeString           (File* file, const StringBuilder* builder);
+
+StringView toStringView        (const char* str);
+StringView toStringView        (const char* str, size_t length);
+StringView toStringView        (const StringBuilder* builder);
+size_t   strLength             (StringView str);
+int      strCompare            (StringView str1, StringView str2);
+char*    strConcatenate        (char* destination, size_t destinationLength, StringView source, size_t maxLength);
+char*    strFind               (StringView str, StringView substr);
+size_t   strNumOfOccurrences   (StringView str, char symbol);
+int      appendString          (StringBuilder* builder, StringView str);
+int      writeString           (File* file, StringView str);
+int      writeLine             (File* file, StringView line);
+
 int      isPunctuationMark     (unsigned char ch);
 int      isLatinLetter         (unsigned char ch);
 int      isCyrillicLetter      (unsigned char ch);